@@ -12,6 +12,18 @@
 #include <linux/kdev_t.h>
 #include <linux/device.h>
 #include <linux/cdev.h>
+#include <linux/mm.h>
+#include <linux/uio.h>
+#include <linux/splice.h>
+#include <linux/sched.h>
+#include <linux/mutex.h>
+#include <linux/percpu.h>
+#include <linux/u64_stats_sync.h>
+#include <linux/uaccess.h>
+#include <linux/compat.h>
+#include <asm/byteorder.h>
+
+#include "dev_ones.h"
 
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Marcin Kłos");
@@ -20,17 +32,30 @@ MODULE_VERSION("1.0.1");
 
 int dev_ones_init(void);
 void dev_ones_exit(void);
-static ssize_t dev_ones_read(struct file *, char *, size_t, loff_t *);
-static ssize_t dev_ones_write(struct file *, const char *, size_t, loff_t *);
+static ssize_t dev_ones_read_iter(struct kiocb *, struct iov_iter *);
+static ssize_t dev_ones_write_iter(struct kiocb *, struct iov_iter *);
+static ssize_t dev_ones_splice_write(struct pipe_inode_info *, struct file *, loff_t *, size_t, unsigned int);
 static int dev_ones_open(struct inode *, struct file *);
+static int dev_ones_mmap(struct file *, struct vm_area_struct *);
+static long dev_ones_ioctl(struct file *, unsigned int, unsigned long);
+#ifdef CONFIG_COMPAT
+static long dev_ones_compat_ioctl(struct file *, unsigned int, unsigned long);
+#endif
 static int dev_ones_release(struct inode *, struct file *);
 
 
 struct file_operations ops = {
 	.owner = THIS_MODULE,
 	.open = dev_ones_open,
-	.read = dev_ones_read,
-	.write = dev_ones_write,
+	.read_iter = dev_ones_read_iter,
+	.splice_read = generic_file_splice_read,
+	.write_iter = dev_ones_write_iter,
+	.splice_write = dev_ones_splice_write,
+	.mmap = dev_ones_mmap,
+	.unlocked_ioctl = dev_ones_ioctl,
+#ifdef CONFIG_COMPAT
+	.compat_ioctl = dev_ones_compat_ioctl,
+#endif
 	.release = dev_ones_release
 };
 
@@ -39,69 +64,506 @@ static struct cdev dev_cdev;
 
 dev_t dev_reg = MKDEV(60, 0);
 
+/* Page filled with ones, shared by all readers. It's never written after
+init, so it can be handed out by reference. */
+static struct page* ones_page;
+
+/* Device nodes and modes they start in, see dev_ones.h */
+#define DEV_ONES_MINORS 3
+
+static const struct {
+	const char* name;
+	unsigned int mode;
+} dev_ones_minors[DEV_ONES_MINORS] = {
+	{ "ones", ONES_MODE_ONES },
+	{ "ones_counter", ONES_MODE_COUNTER },
+	{ "ones_random", ONES_MODE_XORSHIFT },
+};
+
+#define ONES_DEFAULT_SEED 0x9e3779b97f4a7c15ULL
+
+/* Counters of a device node, one set per CPU so parallel readers and writers
+don't bounce a shared cache line. 64-bit counters would tear on 32-bit
+machines, syncp makes readers retry then. Sums and per CPU values are in the
+stats directory of the device in sysfs. */
+struct dev_ones_stats {
+	struct u64_stats_sync syncp;
+	u64 read_bytes;
+	u64 read_calls;
+	u64 write_bytes;
+	u64 write_calls;
+};
+
+static struct dev_ones_stats __percpu* dev_ones_stats[DEV_ONES_MINORS];
+
+/* With sink set writes are accepted and thrown away like by /dev/null, so the
+device can be the measured end of a pipeline. Otherwise they fail with -EIO.
+Nothing is logged either way, accepted writes are counted in stats. Nodes
+are created writable for everyone only when the module is loaded with
+sink=1. */
+static bool sink = false;
+module_param(sink, bool, 0644);
+MODULE_PARM_DESC(sink, "Accept and discard writes (default: 0)");
+
+/* State of open file. Constant modes (ones, byte, pattern) are served from
+a page filled once, phase is the offset of the stream within the pattern.
+Page of a constant mode is never written after it's filled, mode change
+takes a new one, so pipes may keep references to it. Counter and xorshift
+modes use the page as a buffer holding the stream from buf_start. */
+struct ones_file {
+	struct mutex lock;
+	struct ones_mode mode;
+	struct page* page;
+	unsigned int period;
+	unsigned int phase;
+	u64 pos;
+	u64 buf_start;
+	bool buf_valid;
+	u64 state;
+	struct dev_ones_stats __percpu* stats;
+};
+
 static int dev_ones_uevent(struct device *dev, struct kobj_uevent_env *env)
 {
-	add_uevent_var(env, "DEVMODE=%#o", 0444);
+	add_uevent_var(env, "DEVMODE=%#o", sink ? 0666 : 0444);
 	return 0;
 }
 
+static void dev_ones_stats_get(struct dev_ones_stats __percpu * _stats, int _cpu,
+		struct dev_ones_stats * _val) {
+	struct dev_ones_stats* s = per_cpu_ptr(_stats, _cpu);
+	unsigned int start;
+	do {
+		start = u64_stats_fetch_begin(&s->syncp);
+		_val->read_bytes = s->read_bytes;
+		_val->read_calls = s->read_calls;
+		_val->write_bytes = s->write_bytes;
+		_val->write_calls = s->write_calls;
+	} while (u64_stats_fetch_retry(&s->syncp, start));
+}
+
+static void dev_ones_stats_sum(struct device * _dev, struct dev_ones_stats * _sum) {
+	struct dev_ones_stats __percpu** stats = dev_get_drvdata(_dev);
+	struct dev_ones_stats val;
+	int cpu;
+	memset(_sum, 0, sizeof(*_sum));
+	for_each_possible_cpu(cpu) {
+		dev_ones_stats_get(*stats, cpu, &val);
+		_sum->read_bytes += val.read_bytes;
+		_sum->read_calls += val.read_calls;
+		_sum->write_bytes += val.write_bytes;
+		_sum->write_calls += val.write_calls;
+	}
+}
+
+#define DEV_ONES_STATS_ATTR(_field)                                     \
+static ssize_t read_##_field(struct device * _dev,                      \
+		struct device_attribute * _attr, char * _buf) {         \
+	struct dev_ones_stats sum;                                      \
+	dev_ones_stats_sum(_dev, &sum);                                 \
+	return scnprintf(_buf, PAGE_SIZE, "%llu\n", sum._field);        \
+}                                                                       \
+static DEVICE_ATTR(_field, 0444, read_##_field, NULL)
+
+DEV_ONES_STATS_ATTR(read_bytes);
+DEV_ONES_STATS_ATTR(read_calls);
+DEV_ONES_STATS_ATTR(write_bytes);
+DEV_ONES_STATS_ATTR(write_calls);
+
+/* One line per CPU: cpu read_bytes read_calls write_bytes write_calls */
+static ssize_t read_per_cpu(struct device * _dev, struct device_attribute * _attr, char * _buf) {
+	struct dev_ones_stats __percpu** stats = dev_get_drvdata(_dev);
+	struct dev_ones_stats val;
+	ssize_t len = 0;
+	int cpu;
+	for_each_possible_cpu(cpu) {
+		dev_ones_stats_get(*stats, cpu, &val);
+		len += scnprintf(_buf + len, PAGE_SIZE - len, "%d %llu %llu %llu %llu\n",
+				cpu, val.read_bytes, val.read_calls, val.write_bytes,
+				val.write_calls);
+	}
+	return len;
+}
+
+static DEVICE_ATTR(per_cpu, 0444, read_per_cpu, NULL);
+
+static struct attribute* dev_ones_stats_attrs[] = {
+	&dev_attr_read_bytes.attr,
+	&dev_attr_read_calls.attr,
+	&dev_attr_write_bytes.attr,
+	&dev_attr_write_calls.attr,
+	&dev_attr_per_cpu.attr,
+	NULL,
+};
+
+static const struct attribute_group dev_ones_stats_group = {
+	.name = "stats",
+	.attrs = dev_ones_stats_attrs,
+};
+
+static const struct attribute_group* dev_ones_groups[] = {
+	&dev_ones_stats_group,
+	NULL,
+};
+
+static void dev_ones_stats_free(void) {
+	int i;
+	for (i = 0; i < DEV_ONES_MINORS; i++) {
+		free_percpu(dev_ones_stats[i]);
+		dev_ones_stats[i] = NULL;
+	}
+}
+
+static int dev_ones_stats_alloc(void) {
+	int i, cpu;
+	for (i = 0; i < DEV_ONES_MINORS; i++) {
+		dev_ones_stats[i] = alloc_percpu(struct dev_ones_stats);
+		if (dev_ones_stats[i] == NULL) {
+			dev_ones_stats_free();
+			return -ENOMEM;
+		}
+		for_each_possible_cpu(cpu) {
+			u64_stats_init(&per_cpu_ptr(dev_ones_stats[i], cpu)->syncp);
+		}
+	}
+	return 0;
+}
+
+/* Called once per request, not per page, so the cost doesn't grow with the
+request size. */
+static void dev_ones_stats_read(struct dev_ones_stats __percpu * _stats, size_t _bytes) {
+	struct dev_ones_stats* s = get_cpu_ptr(_stats);
+	u64_stats_update_begin(&s->syncp);
+	s->read_bytes += _bytes;
+	s->read_calls++;
+	u64_stats_update_end(&s->syncp);
+	put_cpu_ptr(_stats);
+}
+
+static void dev_ones_stats_write(struct dev_ones_stats __percpu * _stats, size_t _bytes) {
+	struct dev_ones_stats* s = get_cpu_ptr(_stats);
+	u64_stats_update_begin(&s->syncp);
+	s->write_bytes += _bytes;
+	s->write_calls++;
+	u64_stats_update_end(&s->syncp);
+	put_cpu_ptr(_stats);
+}
+
 int dev_ones_init(void)
 {
-	if (alloc_chrdev_region(&dev_reg, 0, 1, "char_dev") < 0) {
-		return -1;
+	struct device * dev;
+	int i = 0;
+	int ret = 0;
+	ones_page = alloc_page(GFP_KERNEL);
+	if (ones_page == NULL) {
+		return -ENOMEM;
+	}
+	memset(page_address(ones_page), 0xff, PAGE_SIZE);
+	ret = dev_ones_stats_alloc();
+	if (ret < 0) {
+		goto stats_error;
 	}
-	if ((dev_cl = class_create(THIS_MODULE, "chardrv")) == NULL) {
-		unregister_chrdev_region(dev_reg, 1);
-		return -1;
+	ret = alloc_chrdev_region(&dev_reg, 0, DEV_ONES_MINORS, "char_dev");
+	if (ret < 0) {
+		goto region_error;
+	}
+	dev_cl = class_create(THIS_MODULE, "chardrv");
+	if (IS_ERR(dev_cl)) {
+		ret = PTR_ERR(dev_cl);
+		goto class_error;
 	}
 	dev_cl->dev_uevent = dev_ones_uevent;
-	if (device_create(dev_cl, NULL, dev_reg, NULL, "ones") == NULL) {
-		class_destroy(dev_cl);
-		unregister_chrdev_region(dev_reg, 1);
-		return -1;
+	dev_cl->dev_groups = dev_ones_groups;
+	for (i = 0; i < DEV_ONES_MINORS; i++) {
+		dev = device_create(dev_cl, NULL, dev_reg + i, &dev_ones_stats[i],
+				dev_ones_minors[i].name);
+		if (IS_ERR(dev)) {
+			ret = PTR_ERR(dev);
+			goto init_error;
+		}
 	}
 	cdev_init(&dev_cdev, &ops);
-	if (cdev_add(&dev_cdev, dev_reg, 1) == -1) {
-		device_destroy(dev_cl, dev_reg);
-		class_destroy(dev_cl);
-		unregister_chrdev_region(dev_reg, 1);
-		return -1;
+	ret = cdev_add(&dev_cdev, dev_reg, DEV_ONES_MINORS);
+	if (ret < 0) {
+		goto init_error;
 	}
 	printk (KERN_INFO "DEVONES: starting...\n");
 	return 0;
+
+init_error:
+	while (i-- > 0) {
+		device_destroy(dev_cl, dev_reg + i);
+	}
+	class_destroy(dev_cl);
+class_error:
+	unregister_chrdev_region(dev_reg, DEV_ONES_MINORS);
+region_error:
+	dev_ones_stats_free();
+stats_error:
+	__free_page(ones_page);
+	return ret;
+}
+
+/* Switches the file to _mode, stream starts from the beginning. Has to be
+called with file lock held. */
+static int ones_file_set_mode(struct ones_file * _f, struct ones_mode * _mode) {
+	struct page* page;
+	unsigned char* p;
+	int i;
+	if (_mode->mode >= ONES_MODES) {
+		return -EINVAL;
+	}
+	if (_mode->mode == ONES_MODE_PATTERN
+			&& (_mode->len == 0 || _mode->len > ONES_PATTERN_MAX)) {
+		return -EINVAL;
+	}
+	if (_mode->mode == ONES_MODE_XORSHIFT && _mode->seed == 0) {
+		return -EINVAL;
+	}
+	if (_mode->mode == ONES_MODE_ONES) {
+		get_page(ones_page);
+		page = ones_page;
+	} else {
+		page = alloc_page(GFP_KERNEL);
+		if (page == NULL) {
+			return -ENOMEM;
+		}
+		p = page_address(page);
+		if (_mode->mode == ONES_MODE_BYTE) {
+			memset(p, _mode->pattern[0], PAGE_SIZE);
+		} else if (_mode->mode == ONES_MODE_PATTERN) {
+			for (i = 0; i < PAGE_SIZE; i++) {
+				p[i] = _mode->pattern[i % _mode->len];
+			}
+		}
+	}
+	if (_f->page != NULL) {
+		put_page(_f->page);
+	}
+	_f->page = page;
+	_f->mode = *_mode;
+	_f->period = (_mode->mode == ONES_MODE_PATTERN) ? _mode->len : 1;
+	_f->phase = 0;
+	_f->pos = 0;
+	_f->buf_valid = false;
+	_f->state = _mode->seed;
+	return 0;
+}
+
+/* Puts stream from word aligned offset _start to the buffer page. Words are
+generated 64 bits at a time, FPU/SIMD registers can't be used freely in the
+kernel. xorshift stream is only read forward, so _start is always the end of
+the previous buffer. */
+static void ones_file_fill(struct ones_file * _f, u64 _start) {
+	__le64* buf = page_address(_f->page);
+	u64 n = _start / 8;
+	u64 x = _f->state;
+	int i;
+	switch (_f->mode.mode) {
+		case ONES_MODE_COUNTER:
+			for (i = 0; i < PAGE_SIZE / 8; i++) {
+				buf[i] = cpu_to_le64(n + i);
+			}
+			break;
+		case ONES_MODE_XORSHIFT:
+			for (i = 0; i < PAGE_SIZE / 8; i++) {
+				x ^= x >> 12;
+				x ^= x << 25;
+				x ^= x >> 27;
+				buf[i] = cpu_to_le64(x * 0x2545f4914f6cdd1dULL);
+			}
+			_f->state = x;
+			break;
+	}
+	_f->buf_start = _start;
+	_f->buf_valid = true;
+}
+
+/* Reads are served a page at a time. Constant modes come from the filled
+page: plain read(), readv() and io_uring get it copied, splice and sendfile
+(pipe iterator) get a reference to the page itself, so nothing is copied at
+all. Counter and xorshift are generated to the buffer page and copied. */
+static ssize_t dev_ones_read_iter(struct kiocb * _iocb, struct iov_iter * _to) {
+	struct ones_file* f = _iocb->ki_filp->private_data;
+	size_t written = 0;
+	size_t off, chunk, n;
+	ssize_t ret = 0;
+	if (mutex_lock_interruptible(&f->lock)) {
+		return -ERESTARTSYS;
+	}
+	while (iov_iter_count(_to)) {
+		if (f->mode.mode == ONES_MODE_COUNTER
+				|| f->mode.mode == ONES_MODE_XORSHIFT) {
+			if (!f->buf_valid || f->pos - f->buf_start >= PAGE_SIZE) {
+				ones_file_fill(f, f->pos & ~7ULL);
+			}
+			off = f->pos - f->buf_start;
+			chunk = min_t(size_t, iov_iter_count(_to), PAGE_SIZE - off);
+			n = copy_to_iter((char*)page_address(f->page) + off, chunk, _to);
+		} else {
+			off = f->phase;
+			chunk = min_t(size_t, iov_iter_count(_to), PAGE_SIZE - off);
+			n = copy_page_to_iter(f->page, off, chunk, _to);
+			f->phase = (f->phase + n) % f->period;
+		}
+		f->pos += n;
+		written += n;
+		if (n < chunk) {
+			ret = -EFAULT;
+			break;
+		}
+		if (signal_pending(current)) {
+			ret = -ERESTARTSYS;
+			break;
+		}
+		cond_resched();
+	}
+	mutex_unlock(&f->lock);
+	dev_ones_stats_read(f->stats, written);
+	return written ? written : ret;
+}
+
+/* Sink, data of write(), writev() and io_uring is never touched, the iterator
+is only moved over it. */
+static ssize_t dev_ones_write_iter(struct kiocb * _iocb, struct iov_iter * _from) {
+	struct ones_file* f = _iocb->ki_filp->private_data;
+	size_t count = iov_iter_count(_from);
+	if (!READ_ONCE(sink)) {
+		return -EIO;
+	}
+	iov_iter_advance(_from, count);
+	dev_ones_stats_write(f->stats, count);
+	return count;
+}
+
+static int ones_pipe_to_sink(struct pipe_inode_info * _pipe, struct pipe_buffer * _buf,
+		struct splice_desc * _sd) {
+	return _sd->len;
+}
+
+/* Pipe buffers are released without being mapped or copied, like splice to
+/dev/null. */
+static ssize_t dev_ones_splice_write(struct pipe_inode_info * _pipe, struct file * _out,
+		loff_t * _ppos, size_t _len, unsigned int _flags) {
+	struct ones_file* f = _out->private_data;
+	ssize_t ret;
+	if (!READ_ONCE(sink)) {
+		return -EIO;
+	}
+	ret = splice_from_pipe(_pipe, _out, _ppos, _len, _flags, ones_pipe_to_sink);
+	if (ret > 0) {
+		dev_ones_stats_write(f->stats, ret);
+	}
+	return ret;
+}
+
+/* Every page of the mapping is the page of ones. Write fault of private
+mapping gets its own copy (copy-on-write is done by the core). */
+static vm_fault_t dev_ones_fault(struct vm_fault * _vmf) {
+	get_page(ones_page);
+	_vmf->page = ones_page;
+	return 0;
 }
 
-static ssize_t dev_ones_read(struct file * _file, char * _buff, size_t _size, loff_t * _offset) {
-	size_t i = 0;
-	long* ptr = (long*)_buff;
-	for (i = 0; i < _size/4; i++) {
-		ptr[i] = 0xffffffff;
+static const struct vm_operations_struct dev_ones_vm_ops = {
+	.fault = dev_ones_fault,
+};
+
+/* Like /dev/zero, any size and offset can be mapped and nothing is filled up
+front, pages are mapped on first touch. Shared mapping would write to the
+page all readers see, so it can't be writable. Other modes than ones can't be
+mapped. */
+static int dev_ones_mmap(struct file * _file, struct vm_area_struct * _vma) {
+	struct ones_file* f = _file->private_data;
+	if (f->mode.mode != ONES_MODE_ONES) {
+		return -EINVAL;
 	}
-	_buff = _buff + (_size - (_size % 4));
-	for (i = 0; i <_size % 4; i++) {
-		_buff[i] = 0xff;
+	if (_vma->vm_flags & VM_SHARED) {
+		if (_vma->vm_flags & VM_WRITE) {
+			return -EPERM;
+		}
+		_vma->vm_flags &= ~VM_MAYWRITE;
+	}
+	_vma->vm_ops = &dev_ones_vm_ops;
+	return 0;
+}
+
+static long dev_ones_ioctl(struct file * _file, unsigned int _cmd, unsigned long _arg) {
+	struct ones_file* f = _file->private_data;
+	struct ones_mode mode;
+	int ret = 0;
+	switch (_cmd) {
+		case IOCTL_ONES_SET_MODE:
+			if (copy_from_user(&mode, (void __user*)_arg, sizeof(mode))) {
+				return -EFAULT;
+			}
+			mutex_lock(&f->lock);
+			ret = ones_file_set_mode(f, &mode);
+			mutex_unlock(&f->lock);
+			return ret;
+		case IOCTL_ONES_GET_MODE:
+			mutex_lock(&f->lock);
+			mode = f->mode;
+			mutex_unlock(&f->lock);
+			if (copy_to_user((void __user*)_arg, &mode, sizeof(mode))) {
+				return -EFAULT;
+			}
+			return 0;
+		default:
+			return -ENOTTY;
 	}
-	return _size;
 }
 
-static ssize_t dev_ones_write(struct file * _file, const char * _buff, size_t _size, loff_t * _offset) {
-	printk (KERN_NOTICE "DEVONES: It's read-only device.\n");
-	return -EIO;
+#ifdef CONFIG_COMPAT
+/* ones_mode has the same layout for 32-bit programs, only the pointer is
+converted (compat_ptr_ioctl() does the same since 5.5). */
+static long dev_ones_compat_ioctl(struct file * _file, unsigned int _cmd, unsigned long _arg) {
+	return dev_ones_ioctl(_file, _cmd, (unsigned long)compat_ptr(_arg));
 }
+#endif
 
+/* Mode of the file is taken from the device node */
 static int dev_ones_open(struct inode * _node, struct file * _file) {
+	struct ones_file* f;
+	struct ones_mode mode = {
+		.seed = ONES_DEFAULT_SEED,
+	};
+	int ret = 0;
+	f = kzalloc(sizeof(*f), GFP_KERNEL);
+	if (f == NULL) {
+		return -ENOMEM;
+	}
+	mutex_init(&f->lock);
+	f->stats = dev_ones_stats[iminor(_node) - MINOR(dev_reg)];
+	mode.mode = dev_ones_minors[iminor(_node) - MINOR(dev_reg)].mode;
+	ret = ones_file_set_mode(f, &mode);
+	if (ret < 0) {
+		kfree(f);
+		return ret;
+	}
+	_file->private_data = f;
 	return 0;
 }
 
 static int dev_ones_release(struct inode * _node, struct file * _file) {
+	struct ones_file* f = _file->private_data;
+	put_page(f->page);
+	kfree(f);
 	return 0;
 }
 
 void dev_ones_exit(void)
 {
-	device_destroy(dev_cl, dev_reg);
+	int i;
+	cdev_del(&dev_cdev);
+	for (i = 0; i < DEV_ONES_MINORS; i++) {
+		device_destroy(dev_cl, dev_reg + i);
+	}
 	class_destroy(dev_cl);
-	unregister_chrdev_region(dev_reg, 1);
+	unregister_chrdev_region(dev_reg, DEV_ONES_MINORS);
+	dev_ones_stats_free();
+	/* pipes may still hold the page, it goes away with the last of them */
+	__free_page(ones_page);
 	printk(KERN_INFO "DEVONES: unloaded.\n");
 }
 
@@ -0,0 +1,58 @@
+#ifndef _DEV_ONES_H_
+#define _DEV_ONES_H_
+
+#include <linux/ioctl.h>
+
+#define ONES_IOCTL_MAGIC              179
+#define ONES_SET_MODE                 0
+#define ONES_GET_MODE                 1
+
+/* Streams the device can produce. Mode is kept per open file, so readers of
+the same device don't disturb each other.
+   ONES_MODE_ONES       0xff bytes, the default
+   ONES_MODE_BYTE       pattern[0] repeated
+   ONES_MODE_PATTERN    first len bytes of pattern repeated
+   ONES_MODE_COUNTER    64-bit little endian words, word at byte offset 8n
+                        holds n
+   ONES_MODE_XORSHIFT   64-bit little endian xorshift64* output from seed */
+#define ONES_MODE_ONES                0
+#define ONES_MODE_BYTE                1
+#define ONES_MODE_PATTERN             2
+#define ONES_MODE_COUNTER             3
+#define ONES_MODE_XORSHIFT            4
+#define ONES_MODES                    5
+
+#define ONES_PATTERN_MAX              64
+
+struct ones_mode {
+	unsigned int mode;
+	unsigned int len;
+	unsigned long long seed;
+	unsigned char pattern[ONES_PATTERN_MAX];
+};
+
+/* Switches the file to the mode given by ones_mode structure and restarts
+the stream from offset 0. len is used by ONES_MODE_PATTERN (1 to
+ONES_PATTERN_MAX), seed by ONES_MODE_XORSHIFT (not 0). Pointer to ones_mode
+structure as argument. */
+#define IOCTL_ONES_SET_MODE           _IOW(ONES_IOCTL_MAGIC, ONES_SET_MODE, struct ones_mode)
+
+/* Returns current mode of the file. Pointer to ones_mode structure as
+argument. */
+#define IOCTL_ONES_GET_MODE           _IOR(ONES_IOCTL_MAGIC, ONES_GET_MODE, struct ones_mode)
+
+/* Besides ioctl, mode can be chosen by the device node: /dev/ones starts in
+ONES_MODE_ONES, /dev/ones_counter in ONES_MODE_COUNTER and /dev/ones_random
+in ONES_MODE_XORSHIFT with the default seed. Only ONES_MODE_ONES can be
+mmap()ed.
+
+Writes fail with EIO unless the module is loaded with sink=1, then they are
+accepted and discarded like by /dev/null (write, writev, io_uring and
+splice).
+
+Every node counts bytes and calls in /sys/class/chardrv/<node>/stats:
+read_bytes, read_calls, write_bytes and write_calls are sums over all CPUs,
+per_cpu has one "cpu read_bytes read_calls write_bytes write_calls" line for
+each CPU. Only accepted writes are counted. */
+
+#endif
@@ -0,0 +1,536 @@
+/* Scaling benchmark of /dev/ones.
+
+Runs N concurrent readers, each with its own open file, for every
+combination of method, block size and thread count, and prints GB/s of the
+slowest, average and fastest thread and of all of them together; threads
+that fail are counted at the end of the line and left out. Methods:
+   read      read() of the whole block
+   readv     readv() of the block split in 4 iovecs
+   splice    splice() to a pipe, drained to /dev/null by splice() again
+   uring     io_uring READV, 2 blocks in flight per thread
+When the device is one of dev_ones nodes, bytes counted by the driver
+(stats/read_bytes in sysfs) are shown as well, they should match the total.
+
+   gcc -O2 -pthread -o ones_bench ones_bench.c
+   ones_bench -t 1,2,4,8 -b 4K,64K,1M,16M -m read,splice -s 2
+   ones_bench -d /dev/zero
+
+io_uring is used through raw system calls, so liburing is not needed; it's
+reported as unsupported on kernels older than 5.1. */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+#define MAX_LIST      32
+#define READV_IOVS    4
+#define URING_DEPTH   2
+
+enum method {
+	METHOD_READ,
+	METHOD_READV,
+	METHOD_SPLICE,
+	METHOD_URING,
+	METHODS
+};
+
+static const char* method_names[METHODS] = {
+	"read", "readv", "splice", "uring"
+};
+
+struct worker {
+	pthread_t thread;
+	enum method method;
+	size_t block;
+	int err;
+	uint64_t bytes;
+	double secs;
+};
+
+static const char* dev_path = "/dev/ones";
+/* Set by the main thread when the run is over, polled by the workers */
+static int stop;
+static pthread_barrier_t start_barrier;
+
+static int stopped(void) {
+	return __atomic_load_n(&stop, __ATOMIC_RELAXED);
+}
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int bench_read(struct worker * _w, int _fd, char * _buf) {
+	ssize_t n;
+	while (!stopped()) {
+		n = read(_fd, _buf, _w->block);
+		if (n <= 0) {
+			return n < 0 ? errno : EIO;
+		}
+		_w->bytes += n;
+	}
+	return 0;
+}
+
+static int bench_readv(struct worker * _w, int _fd, char * _buf) {
+	struct iovec iov[READV_IOVS];
+	size_t part = _w->block / READV_IOVS;
+	ssize_t n;
+	int i;
+	for (i = 0; i < READV_IOVS; i++) {
+		iov[i].iov_base = _buf + i * part;
+		iov[i].iov_len = (i == READV_IOVS - 1) ? _w->block - i * part : part;
+	}
+	while (!stopped()) {
+		n = readv(_fd, iov, READV_IOVS);
+		if (n <= 0) {
+			return n < 0 ? errno : EIO;
+		}
+		_w->bytes += n;
+	}
+	return 0;
+}
+
+/* Pipe is sized to the block where it's allowed (pipe-max-size, 1 MiB by
+default), bigger blocks are moved in several rounds. */
+static int bench_splice(struct worker * _w, int _fd) {
+	int p[2], null_fd, ret = 0;
+	ssize_t in, out;
+	size_t left, pipe_size;
+	if (pipe(p) < 0) {
+		return errno;
+	}
+	null_fd = open("/dev/null", O_WRONLY);
+	if (null_fd < 0) {
+		ret = errno;
+		goto splice_error;
+	}
+	fcntl(p[1], F_SETPIPE_SZ, _w->block);
+	pipe_size = fcntl(p[1], F_GETPIPE_SZ);
+	while (!stopped() && ret == 0) {
+		for (left = _w->block; left > 0; left -= in) {
+			in = splice(_fd, NULL, p[1], NULL,
+					left < pipe_size ? left : pipe_size, SPLICE_F_MOVE);
+			if (in <= 0) {
+				ret = in < 0 ? errno : EIO;
+				break;
+			}
+			_w->bytes += in;
+			for (out = in; out > 0; ) {
+				ssize_t n = splice(p[0], NULL, null_fd, NULL, out, SPLICE_F_MOVE);
+				if (n <= 0) {
+					ret = n < 0 ? errno : EIO;
+					break;
+				}
+				out -= n;
+			}
+			if (ret) {
+				break;
+			}
+		}
+	}
+	close(null_fd);
+splice_error:
+	close(p[0]);
+	close(p[1]);
+	return ret;
+}
+
+#ifdef __NR_io_uring_setup
+
+struct uring {
+	int fd;
+	unsigned* sq_tail;
+	unsigned* sq_mask;
+	unsigned* sq_array;
+	unsigned* cq_head;
+	unsigned* cq_tail;
+	unsigned* cq_mask;
+	struct io_uring_sqe* sqes;
+	struct io_uring_cqe* cqes;
+	void* sq_ring;
+	void* cq_ring;
+	size_t sq_size;
+	size_t cq_size;
+	size_t sqes_size;
+};
+
+static int uring_setup(struct uring * _r, unsigned _depth) {
+	struct io_uring_params p;
+	char* sq;
+	char* cq;
+	memset(&p, 0, sizeof(p));
+	_r->fd = syscall(__NR_io_uring_setup, _depth, &p);
+	if (_r->fd < 0) {
+		return errno;
+	}
+	_r->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	_r->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	_r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	_r->sq_ring = mmap(NULL, _r->sq_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, _r->fd, IORING_OFF_SQ_RING);
+	_r->cq_ring = mmap(NULL, _r->cq_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, _r->fd, IORING_OFF_CQ_RING);
+	_r->sqes = mmap(NULL, _r->sqes_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, _r->fd, IORING_OFF_SQES);
+	if (_r->sq_ring == MAP_FAILED || _r->cq_ring == MAP_FAILED
+			|| _r->sqes == MAP_FAILED) {
+		close(_r->fd);
+		return ENOMEM;
+	}
+	sq = _r->sq_ring;
+	cq = _r->cq_ring;
+	_r->sq_tail = (unsigned*)(sq + p.sq_off.tail);
+	_r->sq_mask = (unsigned*)(sq + p.sq_off.ring_mask);
+	_r->sq_array = (unsigned*)(sq + p.sq_off.array);
+	_r->cq_head = (unsigned*)(cq + p.cq_off.head);
+	_r->cq_tail = (unsigned*)(cq + p.cq_off.tail);
+	_r->cq_mask = (unsigned*)(cq + p.cq_off.ring_mask);
+	_r->cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+	return 0;
+}
+
+static void uring_free(struct uring * _r) {
+	munmap(_r->sqes, _r->sqes_size);
+	munmap(_r->cq_ring, _r->cq_size);
+	munmap(_r->sq_ring, _r->sq_size);
+	close(_r->fd);
+}
+
+/* Only queues the request, it's submitted by the next uring_enter() */
+static void uring_queue_readv(struct uring * _r, int _fd, struct iovec * _iov,
+		unsigned long long _data) {
+	unsigned tail = *_r->sq_tail;
+	unsigned idx = tail & *_r->sq_mask;
+	struct io_uring_sqe* sqe = &_r->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = IORING_OP_READV;
+	sqe->fd = _fd;
+	sqe->addr = (unsigned long)_iov;
+	sqe->len = 1;
+	sqe->user_data = _data;
+	_r->sq_array[idx] = idx;
+	__atomic_store_n(_r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+static int uring_enter(struct uring * _r, unsigned _submit, unsigned _wait) {
+	if (syscall(__NR_io_uring_enter, _r->fd, _submit, _wait,
+			IORING_ENTER_GETEVENTS, NULL, 0) < 0) {
+		return errno;
+	}
+	return 0;
+}
+
+static int bench_uring(struct worker * _w, int _fd, char * _buf) {
+	struct uring r;
+	struct iovec iov[URING_DEPTH];
+	struct io_uring_cqe* cqe;
+	unsigned head, submit = URING_DEPTH, inflight = 0;
+	int i, ret;
+	ret = uring_setup(&r, URING_DEPTH);
+	if (ret) {
+		return ret;
+	}
+	for (i = 0; i < URING_DEPTH; i++) {
+		iov[i].iov_base = _buf + i * _w->block;
+		iov[i].iov_len = _w->block;
+		uring_queue_readv(&r, _fd, &iov[i], i);
+	}
+	while (inflight + submit > 0) {
+		ret = uring_enter(&r, submit, 1);
+		if (ret) {
+			break;
+		}
+		inflight += submit;
+		submit = 0;
+		head = *r.cq_head;
+		while (head != __atomic_load_n(r.cq_tail, __ATOMIC_ACQUIRE)) {
+			cqe = &r.cqes[head & *r.cq_mask];
+			head++;
+			inflight--;
+			if (cqe->res <= 0) {
+				ret = cqe->res < 0 ? -cqe->res : EIO;
+				continue;
+			}
+			_w->bytes += cqe->res;
+			if (!stopped() && ret == 0) {
+				uring_queue_readv(&r, _fd, &iov[cqe->user_data], cqe->user_data);
+				submit++;
+			}
+		}
+		__atomic_store_n(r.cq_head, head, __ATOMIC_RELEASE);
+	}
+	uring_free(&r);
+	return ret;
+}
+
+#else
+
+static int bench_uring(struct worker * _w, int _fd, char * _buf) {
+	return ENOSYS;
+}
+
+#endif
+
+static void* worker_run(void * _arg) {
+	struct worker* w = _arg;
+	size_t buf_size = w->block * (w->method == METHOD_URING ? URING_DEPTH : 1);
+	char* buf = NULL;
+	double start;
+	int fd;
+	fd = open(dev_path, O_RDONLY);
+	if (fd < 0) {
+		w->err = errno;
+	} else if (w->method != METHOD_SPLICE
+			&& posix_memalign((void**)&buf, 4096, buf_size)) {
+		w->err = ENOMEM;
+	} else if (buf != NULL) {
+		/* fault the buffer in before the clock starts */
+		memset(buf, 0, buf_size);
+	}
+	pthread_barrier_wait(&start_barrier);
+	start = now();
+	if (w->err == 0) {
+		switch (w->method) {
+			case METHOD_READ:
+				w->err = bench_read(w, fd, buf);
+				break;
+			case METHOD_READV:
+				w->err = bench_readv(w, fd, buf);
+				break;
+			case METHOD_SPLICE:
+				w->err = bench_splice(w, fd);
+				break;
+			default:
+				w->err = bench_uring(w, fd, buf);
+				break;
+		}
+	}
+	w->secs = now() - start;
+	free(buf);
+	if (fd >= 0) {
+		close(fd);
+	}
+	return NULL;
+}
+
+/* Bytes the driver counted for the device, -1 if it's not a dev_ones node */
+static long long kernel_bytes(void) {
+	const char* name = strrchr(dev_path, '/');
+	char path[256];
+	long long val = -1;
+	FILE* f;
+	snprintf(path, sizeof(path), "/sys/class/chardrv/%s/stats/read_bytes",
+			name ? name + 1 : dev_path);
+	f = fopen(path, "r");
+	if (f == NULL) {
+		return -1;
+	}
+	if (fscanf(f, "%lld", &val) != 1) {
+		val = -1;
+	}
+	fclose(f);
+	return val;
+}
+
+static int run(enum method _method, size_t _block, int _threads, double _secs) {
+	struct worker* w = calloc(_threads, sizeof(*w));
+	struct timespec ts;
+	long long kstart, kend;
+	double wall, rate, min = 0, max = 0, sum = 0;
+	uint64_t total = 0;
+	int i, ok = 0, failed = 0, err = 0;
+	if (w == NULL) {
+		return ENOMEM;
+	}
+	__atomic_store_n(&stop, 0, __ATOMIC_RELAXED);
+	pthread_barrier_init(&start_barrier, NULL, _threads + 1);
+	for (i = 0; i < _threads; i++) {
+		w[i].method = _method;
+		w[i].block = _block;
+		pthread_create(&w[i].thread, NULL, worker_run, &w[i]);
+	}
+	kstart = kernel_bytes();
+	pthread_barrier_wait(&start_barrier);
+	wall = now();
+	ts.tv_sec = (time_t)_secs;
+	ts.tv_nsec = (long)((_secs - ts.tv_sec) * 1e9);
+	nanosleep(&ts, NULL);
+	__atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+	for (i = 0; i < _threads; i++) {
+		pthread_join(w[i].thread, NULL);
+	}
+	wall = now() - wall;
+	kend = kernel_bytes();
+	/* failed workers are left out, their partial rate would skew min and
+	avg; the kernel column still counts what they read */
+	for (i = 0; i < _threads; i++) {
+		if (w[i].err) {
+			err = w[i].err;
+			failed++;
+			continue;
+		}
+		rate = w[i].bytes / w[i].secs / 1e9;
+		if (ok == 0 || rate < min) {
+			min = rate;
+		}
+		if (rate > max) {
+			max = rate;
+		}
+		sum += rate;
+		total += w[i].bytes;
+		ok++;
+	}
+	pthread_barrier_destroy(&start_barrier);
+	printf("%-7s %8zuK %7d ", method_names[_method], _block / 1024, _threads);
+	if (ok == 0) {
+		printf("  %s\n", strerror(err));
+	} else {
+		printf("%8.2f %8.2f %8.2f %9.2f", min, sum / ok, max,
+				total / wall / 1e9);
+		if (kstart >= 0 && kend >= 0) {
+			printf(" %9.2f", (kend - kstart) / wall / 1e9);
+		} else {
+			printf(" %9s", "-");
+		}
+		if (failed) {
+			printf("  %d failed: %s", failed, strerror(err));
+		}
+		printf("\n");
+	}
+	fflush(stdout);
+	free(w);
+	return err;
+}
+
+static size_t parse_size(const char * _s) {
+	char* end;
+	unsigned long long v = strtoull(_s, &end, 0);
+	switch (*end) {
+		case 'k': case 'K':
+			return v << 10;
+		case 'm': case 'M':
+			return v << 20;
+		case 'g': case 'G':
+			return v << 30;
+		default:
+			return v;
+	}
+}
+
+/* Splits comma separated list in place, returns number of items */
+static int split(char * _s, char ** _items) {
+	int n = 0;
+	char* tok;
+	for (tok = strtok(_s, ","); tok != NULL && n < MAX_LIST; tok = strtok(NULL, ",")) {
+		_items[n++] = tok;
+	}
+	return n;
+}
+
+static void usage(const char * _prog) {
+	fprintf(stderr,
+		"usage: %s [-d device] [-t threads,...] [-b block,...] "
+		"[-m method,...] [-s seconds]\n"
+		"   defaults: -d /dev/ones -t 1,2,4,<cpus> -b 4K,64K,1M,16M "
+		"-m read,readv,splice,uring -s 1\n", _prog);
+}
+
+int main(int argc, char ** argv) {
+	char def_threads[64];
+	char def_blocks[] = "4K,64K,1M,16M";
+	char def_methods[] = "read,readv,splice,uring";
+	char* threads_arg = def_threads;
+	char* blocks_arg = def_blocks;
+	char* methods_arg = def_methods;
+	char* items[MAX_LIST];
+	int threads[MAX_LIST], methods[MAX_LIST];
+	size_t blocks[MAX_LIST];
+	int nthreads, nblocks, nmethods;
+	double secs = 1;
+	int i, j, k, m, opt, failed = 0;
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (cpus > 4) {
+		snprintf(def_threads, sizeof(def_threads), "1,2,4,%ld", cpus);
+	} else {
+		snprintf(def_threads, sizeof(def_threads), "1,2,4");
+	}
+	while ((opt = getopt(argc, argv, "d:t:b:m:s:h")) != -1) {
+		switch (opt) {
+			case 'd':
+				dev_path = optarg;
+				break;
+			case 't':
+				threads_arg = optarg;
+				break;
+			case 'b':
+				blocks_arg = optarg;
+				break;
+			case 'm':
+				methods_arg = optarg;
+				break;
+			case 's':
+				secs = atof(optarg);
+				break;
+			default:
+				usage(argv[0]);
+				return opt == 'h' ? 0 : 2;
+		}
+	}
+	nthreads = split(threads_arg, items);
+	for (i = 0; i < nthreads; i++) {
+		threads[i] = atoi(items[i]);
+		if (threads[i] <= 0) {
+			fprintf(stderr, "bad thread count: %s\n", items[i]);
+			return 2;
+		}
+	}
+	nblocks = split(blocks_arg, items);
+	for (i = 0; i < nblocks; i++) {
+		blocks[i] = parse_size(items[i]);
+		if (blocks[i] < READV_IOVS) {
+			fprintf(stderr, "bad block size: %s\n", items[i]);
+			return 2;
+		}
+	}
+	nmethods = split(methods_arg, items);
+	for (i = 0; i < nmethods; i++) {
+		for (m = 0; m < METHODS && strcmp(items[i], method_names[m]); m++);
+		if (m == METHODS) {
+			fprintf(stderr, "unknown method: %s\n", items[i]);
+			return 2;
+		}
+		methods[i] = m;
+	}
+	if (secs <= 0) {
+		fprintf(stderr, "bad duration\n");
+		return 2;
+	}
+	printf("%s, %ld CPUs, %.1f s per run, GB/s = 10^9 bytes/s\n",
+			dev_path, cpus, secs);
+	printf("%-7s %9s %7s %8s %8s %8s %9s %9s\n", "method", "block",
+			"threads", "min", "avg", "max", "total", "kernel");
+	for (i = 0; i < nmethods; i++) {
+		for (j = 0; j < nblocks; j++) {
+			for (k = 0; k < nthreads; k++) {
+				if (run(methods[i], blocks[j], threads[k], secs)) {
+					failed = 1;
+				}
+			}
+		}
+	}
+	return failed;
+}
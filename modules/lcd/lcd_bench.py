@@ -0,0 +1,290 @@
+#!/usr/bin/env python3
+# Latency and throughput benchmark of the LCD drivers.
+#
+# Drives /dev/hdpcfN ioctls (lcd_hdpcf) or the sysfs content attribute
+# (lcd_drv) with repeatable workloads and prints p50/p99/max latency of
+# single request, requests per second and bus bytes per request. Bus bytes
+# are taken from hdpcf debugfs stats or from lcd_emu state, whichever is
+# there (needs root), otherwise they are not reported.
+#
+#    lcd_bench.py --dev /dev/hdpcf0 -n 500
+#    lcd_bench.py --sysfs /sys/bus/i2c/devices/1-0027 -w full,digit
+#    lcd_bench.py -w anim,batch
+#
+# With lcd_hdpcf loaded with async_flush=1 use --sync, so every request is
+# measured until it's on the LCD.
+
+import argparse
+import ctypes
+import fcntl
+import os
+import struct
+import sys
+import time
+
+IOCTL_MAGIC = 178
+LCD_UPDATE_STATE = 0
+LCD_UPDATE_DISPLAY = 1
+LCD_CLEAR = 2
+LCD_SET_CHAR = 5
+LCD_SYNC = 6
+LCD_SUBMIT = 13
+LCD_BACK_WRITE = 14
+LCD_COMMIT = 15
+LCD_SET_PRIO = 16
+LCD_HDPCF_VERSION = 1
+
+WORKLOADS = ['full', 'digit', 'cgram', 'state', 'clear', 'anim', 'batch',
+   'commit']
+
+
+def _iowr(nr):
+   # _IOWR(IOCTL_MAGIC, nr, unsigned long)
+   return (3 << 30) | (struct.calcsize('L') << 16) | (IOCTL_MAGIC << 8) | nr
+
+
+def pack_lcd(lines, cursor=False, blink=False, display=True, backlight=True):
+   # struct lcd_hdpcf: unsigned char buffer[2][17], four bools
+   buf = b''
+   for line in lines:
+      buf += line.encode('latin-1')[:16].ljust(16) + b'\0'
+   return buf + struct.pack('4?', cursor, blink, display, backlight)
+
+
+def pack_char(rows, address):
+   # struct user_char: unsigned char chr[8], address
+   return struct.pack('8BB', *rows, address)
+
+
+def pack_back(row, col, text):
+   # struct lcd_back_write: version, row, col, len, text[40]
+   text = text.encode('latin-1')[:40]
+   return struct.pack('IBBB40sx', LCD_HDPCF_VERSION, row, col, len(text),
+      text)
+
+
+def pack_op(nr, payload=b''):
+   # struct lcd_op: op, result, union of ioctl arguments (164 bytes)
+   return struct.pack('Ii', nr, 0) + payload.ljust(164, b'\0')
+
+
+def read_counter(path, name):
+   try:
+      with open(path) as f:
+         for line in f:
+            key, _, value = line.partition(' ')
+            if key == name:
+               return int(value.split()[0], 0)
+   except OSError:
+      pass
+   return None
+
+
+class BusBytes:
+   # Bytes put on the bus, from the driver's own statistics or from the
+   # emulator.
+   def __init__(self, minor):
+      self.sources = []
+      if minor is not None:
+         self.sources.append('/sys/kernel/debug/hdpcf/hdpcf%d/stats' % minor)
+      self.sources.append('/sys/kernel/debug/lcd_emu/state')
+
+   def read(self):
+      for path in self.sources:
+         value = read_counter(path, 'bytes')
+         if value is not None:
+            return value
+      return None
+
+
+class HdpcfTarget:
+   def __init__(self, dev, sync, prio):
+      self.fd = os.open(dev, os.O_RDWR)
+      self.sync = sync
+      self.minor = os.minor(os.fstat(self.fd).st_rdev)
+      fcntl.ioctl(self.fd, _iowr(LCD_SET_PRIO), prio)
+
+   def ioctl(self, nr, arg):
+      fcntl.ioctl(self.fd, _iowr(nr), arg)
+      if self.sync:
+         fcntl.ioctl(self.fd, _iowr(LCD_SYNC), 0)
+
+   def display(self, lines):
+      self.ioctl(LCD_UPDATE_DISPLAY, pack_lcd(lines))
+
+   def state(self, on):
+      self.ioctl(LCD_UPDATE_STATE, pack_lcd(['', ''], cursor=on, blink=on))
+
+   def set_char(self, rows, address):
+      self.ioctl(LCD_SET_CHAR, pack_char(rows, address))
+
+   def clear(self):
+      self.ioctl(LCD_CLEAR, 0)
+
+   def submit(self, ops):
+      # struct lcd_submit: version, count, address of lcd_op array
+      buf = ctypes.create_string_buffer(b''.join(ops))
+      self.ioctl(LCD_SUBMIT, struct.pack('IIQ', LCD_HDPCF_VERSION, len(ops),
+         ctypes.addressof(buf)))
+
+   def commit(self, lines):
+      # back buffer is not shown, so only the commit is synced
+      for row, line in enumerate(lines):
+         fcntl.ioctl(self.fd, _iowr(LCD_BACK_WRITE), pack_back(row, 0, line))
+      self.ioctl(LCD_COMMIT, 0)
+
+
+class SysfsTarget:
+   minor = None
+
+   def __init__(self, path):
+      self.content = os.open(os.path.join(path, 'content'), os.O_WRONLY)
+      self.backlight = os.open(os.path.join(path, 'backlight'), os.O_WRONLY)
+      self.display_clear = os.path.join(path, 'display_clear')
+
+   def display(self, lines):
+      os.write(self.content, ('\n'.join(lines) + '\n').encode('latin-1'))
+
+   def state(self, on):
+      os.write(self.backlight, b'1' if on else b'0')
+
+   def set_char(self, rows, address):
+      raise NotImplementedError
+
+   def clear(self):
+      with open(self.display_clear, 'w') as f:
+         f.write('1')
+
+   def submit(self, ops):
+      raise NotImplementedError
+
+   def commit(self, lines):
+      raise NotImplementedError
+
+
+# Workloads, each call is one measured request
+
+def wl_full(target, i):
+   # every cell changes
+   c = 'AB'[i % 2]
+   target.display([c * 16, c * 16])
+
+
+def wl_digit(target, i):
+   # clock like, only the last digit changes
+   target.display(['LCD BENCH', 'count %10d' % i])
+
+
+CGRAM_FRAMES = [[0x1f >> (n % 5) for _ in range(8)] for n in range(5)]
+
+
+def wl_cgram(target, i):
+   # animation of user character 0
+   target.set_char(CGRAM_FRAMES[i % len(CGRAM_FRAMES)], 0)
+
+
+def wl_state(target, i):
+   target.state(i % 2 == 0)
+
+
+def wl_clear(target, i):
+   target.clear()
+
+
+def anim_frame(i):
+   # 3 user characters reloaded and the line showing them
+   chars = [(CGRAM_FRAMES[(i + n) % len(CGRAM_FRAMES)], n) for n in range(3)]
+   lines = ['ANIM \x00\x01\x02', 'frame %10d' % i]
+   return chars, lines
+
+
+def wl_anim(target, i):
+   # one request per operation
+   chars, lines = anim_frame(i)
+   for rows, address in chars:
+      target.set_char(rows, address)
+   target.display(lines)
+
+
+def wl_batch(target, i):
+   # the same frame as anim in a single IOCTL_LCD_SUBMIT
+   chars, lines = anim_frame(i)
+   ops = [pack_op(LCD_SET_CHAR, pack_char(rows, address))
+      for rows, address in chars]
+   ops.append(pack_op(LCD_UPDATE_DISPLAY, pack_lcd(lines)))
+   target.submit(ops)
+
+
+def wl_commit(target, i):
+   # digit like update through the back buffer
+   target.commit(['LCD BENCH', 'count %10d' % i])
+
+
+def percentile(sorted_values, p):
+   k = int(round(p / 100.0 * (len(sorted_values) - 1)))
+   return sorted_values[min(k, len(sorted_values) - 1)]
+
+
+def run(target, name, count, warmup):
+   func = globals()['wl_' + name]
+   bus = BusBytes(target.minor)
+   for i in range(warmup):
+      func(target, i)
+   lat = []
+   before = bus.read()
+   start = time.perf_counter_ns()
+   for i in range(count):
+      t = time.perf_counter_ns()
+      func(target, warmup + i)
+      lat.append(time.perf_counter_ns() - t)
+   elapsed = time.perf_counter_ns() - start
+   after = bus.read()
+   lat.sort()
+   if before is not None and after is not None:
+      per_frame = '%.1f' % ((after - before) / float(count))
+   else:
+      per_frame = 'n/a'
+   print('%-8s %6d %10.1f %10.1f %10.1f %10.1f %12s' % (name, count,
+      percentile(lat, 50) / 1000.0, percentile(lat, 99) / 1000.0,
+      lat[-1] / 1000.0, count / (elapsed / 1e9), per_frame))
+
+
+def main():
+   parser = argparse.ArgumentParser(
+      description='Latency and throughput benchmark of the LCD drivers')
+   group = parser.add_mutually_exclusive_group()
+   group.add_argument('--dev', default='/dev/hdpcf0',
+      help='lcd_hdpcf character device (default: /dev/hdpcf0)')
+   group.add_argument('--sysfs',
+      help='lcd_drv device directory, e.g. /sys/bus/i2c/devices/1-0027')
+   parser.add_argument('-n', '--count', type=int, default=200,
+      help='measured requests per workload (default: 200)')
+   parser.add_argument('--warmup', type=int, default=10,
+      help='requests before measuring (default: 10)')
+   parser.add_argument('-w', '--workloads', default=','.join(WORKLOADS),
+      help='comma separated list of ' + ', '.join(WORKLOADS))
+   parser.add_argument('--sync', action='store_true',
+      help='issue IOCTL_LCD_SYNC after every request')
+   parser.add_argument('--prio', type=int, choices=[0, 1], default=0,
+      help='request class of lcd_hdpcf, 1 is high priority; run a high '
+      'priority instance next to a normal one to see preemption (default: 0)')
+   args = parser.parse_args()
+
+   if args.sysfs:
+      target = SysfsTarget(args.sysfs)
+   else:
+      target = HdpcfTarget(args.dev, args.sync, args.prio)
+
+   print('%-8s %6s %10s %10s %10s %10s %12s' % ('workload', 'n', 'p50_us',
+      'p99_us', 'max_us', 'frames/s', 'bytes/frame'))
+   for name in args.workloads.split(','):
+      if name not in WORKLOADS:
+         sys.exit('unknown workload: ' + name)
+      try:
+         run(target, name, args.count, args.warmup)
+      except NotImplementedError:
+         print('%-8s not supported by this driver' % name)
+
+
+if __name__ == '__main__':
+   main()
@@ -11,6 +11,8 @@
 #include <linux/interrupt.h>
 #include <linux/regulator/consumer.h>
 #include <linux/delay.h>
+#include <linux/ktime.h>
+#include <linux/of.h>
 
 MODULE_AUTHOR("Marcin Kłos");
 MODULE_DESCRIPTION("HD44780 on I2C (with PCF8574T gpio expander)");
@@ -34,6 +36,19 @@ MODULE_LICENSE("GPL");
 #define LCD_CURSOR_BLINK   0x01
 #define LCD_DISPLAY        0x04
 
+/* HD44780 busy flag can be read back through PCF8574 (LCD_RW line). When
+enabled, commands wait for the controller instead of worst case delays, which
+remain as fallback. */
+static bool busy_poll;
+module_param(busy_poll, bool, 0644);
+MODULE_PARM_DESC(busy_poll, "Poll HD44780 busy flag instead of fixed delays "
+   "(default: 0)");
+
+static unsigned int busy_timeout_us = 10000;
+module_param(busy_timeout_us, uint, 0644);
+MODULE_PARM_DESC(busy_timeout_us, "Busy flag polling timeout in us, fixed "
+   "delay is used after it (default: 10000)");
+
 static int hd44780_i2c_probe(struct i2c_client* _client,
       const struct i2c_device_id* _id);
 static int hd44780_i2c_remove(struct i2c_client* _client);
@@ -41,26 +56,64 @@ static int hd44780_i2c_remove(struct i2c_client* _client);
 /* --- */
 
 /* Typicaly i2c to hd44780 module uses PCF8475T with address 
-   0x27. User has to take care to modify this driver, when 
-   address is different. Usually A0, A1 and A2 address lines
-   are set by resistors on pcb. */
+   0x27. Usually A0, A1 and A2 address lines are set by resistors
+   on pcb. Displays at other addresses or buses are given by bus
+   and addr module parameters or by the device tree. */
 static const unsigned short normal_i2c[] = { 0x27, I2C_CLIENT_END };
 
+#define LCD_MAX_DEVICES    16
+
+static unsigned short bus[LCD_MAX_DEVICES];
+static int bus_num;
+module_param_array(bus, ushort, &bus_num, 0444);
+MODULE_PARM_DESC(bus, "I2C bus numbers of displays created at load time "
+   "(default: 1)");
+
+static unsigned short addr[LCD_MAX_DEVICES];
+static int addr_num;
+module_param_array(addr, ushort, &addr_num, 0444);
+MODULE_PARM_DESC(addr, "I2C addresses of displays, one for each bus entry "
+   "(default: 0x27)");
+
 static const struct i2c_device_id lcd_id[] = {
    { "hd44780_i2c", 0 },
    { }
 };
 MODULE_DEVICE_TABLE(i2c, lcd_id);
 
-struct i2c_board_info info = {
-   .type = "hd44780_i2c",
-   .addr = 0x27,
+static const struct of_device_id lcd_of_match[] = {
+   { .compatible = "mklos,hd44780-i2c" },
+   { }
+};
+MODULE_DEVICE_TABLE(of, lcd_of_match);
+
+/* Clients created from module parameters, unregistered on exit */
+static struct i2c_client* lcd_clients[LCD_MAX_DEVICES];
+
+/* Frame encoder. Every HD44780 write in 4-bit mode costs four PCF8574 output
+states: high nibble with E high, the same with E low and then the same for
+the low nibble. Instead of a separate SMBus transaction for each state, the
+states are collected in a frame and put on the bus with as few messages as the
+adapter accepts. PCF8574 latches every byte of a write transaction on its
+outputs, so the waveform on the LCD pins stays the same. Full frame is
+flushed automatically, so callers don't have to care about its size. */
+#define LCD_FRAME_SIZE     256
+
+/* SMBus I2C block write carries a command byte and up to 32 data bytes. For
+PCF8574 the command byte is just one more output state. */
+#define LCD_SMBUS_CHUNK    (I2C_SMBUS_BLOCK_MAX + 1)
+
+struct hd44780_frame {
+   unsigned char buf[LCD_FRAME_SIZE];
+   int len;
 };
 
-static struct i2c_client *client;
-
+/* Frame and the rest of the state are shared by all sysfs writers of the
+device, lock serializes every sequence put on the bus. */
 struct hd44780_data {
    struct i2c_client* client;
+   struct mutex lock;
+   struct hd44780_frame frame;
    unsigned char disp_data[16][2];
    unsigned char backlight;
    unsigned char pcf_state;
@@ -75,6 +128,7 @@ static struct i2c_driver hd44780_i2c_driver = {
    .class = I2C_CLASS_HWMON,
    .driver = {
       .name = "hd44780_i2c",
+      .of_match_table = of_match_ptr(lcd_of_match),
    },
    .probe = hd44780_i2c_probe,
    .remove = hd44780_i2c_remove,
@@ -82,35 +136,147 @@ static struct i2c_driver hd44780_i2c_driver = {
    .id_table = lcd_id,
 };
 
-/* Function return negative if error */
+/* Puts whole frame on the bus and empties it. Messages are as long as the
+adapter allows. Adapters without plain I2C support get SMBus block writes or,
+as a last resort, one byte per transaction. Has to be called with lock held.
+Function return negative if error */
+static int hd44780_frame_flush(struct i2c_client* _client) {
+   struct hd44780_data* data = i2c_get_clientdata(_client);
+   struct hd44780_frame* frame = &data->frame;
+   struct i2c_adapter* adapter = _client->adapter;
+   int chunk = frame->len;
+   int pos = 0;
+   int len;
+   int ret = 0;
+
+   if (i2c_check_functionality(adapter, I2C_FUNC_I2C)) {
+      if (adapter->quirks && adapter->quirks->max_write_len)
+         chunk = min_t(int, chunk, adapter->quirks->max_write_len);
+   } else if (i2c_check_functionality(adapter,
+         I2C_FUNC_SMBUS_WRITE_I2C_BLOCK)) {
+      chunk = min_t(int, chunk, LCD_SMBUS_CHUNK);
+   } else {
+      chunk = 1;
+   }
+
+   while (pos < frame->len) {
+      len = min_t(int, chunk, frame->len - pos);
+      if (len == 1) {
+         ret = i2c_smbus_write_byte(_client, frame->buf[pos]);
+      } else if (i2c_check_functionality(adapter, I2C_FUNC_I2C)) {
+         ret = i2c_master_send(_client, (const char*)&frame->buf[pos], len);
+         if (ret >= 0 && ret != len) ret = -EIO;
+      } else {
+         ret = i2c_smbus_write_i2c_block_data(_client, frame->buf[pos],
+            len - 1, &frame->buf[pos + 1]);
+      }
+      if (ret < 0) break;
+      pos += len;
+   }
+   frame->len = 0;
+   return (ret < 0) ? ret : 0;
+}
+
+/* Appends single PCF8574 output state to the frame. Has to be called with
+lock held. */
+static int hd44780_frame_put_raw(struct i2c_client* _client,
+      unsigned char _state) {
+   struct hd44780_data* data = i2c_get_clientdata(_client);
+   int ret = 0;
+   if (data->frame.len == LCD_FRAME_SIZE) {
+      ret = hd44780_frame_flush(_client);
+      if (ret < 0) return ret;
+   }
+   data->frame.buf[data->frame.len++] = _state;
+   return 0;
+}
+
+/* Appends one command or data byte (four output states) to the frame. Has
+to be called with lock held. Function return negative if error */
+static int hd44780_frame_put(struct i2c_client* _client, char _mode,
+      char _data) {
+   struct hd44780_data* data = i2c_get_clientdata(_client);
+   unsigned char ctl = data->backlight | ((_mode == LCD_MODE_CMD) ? 0
+      : LCD_RS);
+   unsigned char hi = 0xf0 & _data;
+   unsigned char lo = (0x0f & _data) << 4;
+   int ret = 0;
+   if (data->frame.len > LCD_FRAME_SIZE - 4) {
+      ret = hd44780_frame_flush(_client);
+      if (ret < 0) return ret;
+   }
+   data->frame.buf[data->frame.len++] = hi | ctl | LCD_CS;
+   data->frame.buf[data->frame.len++] = hi | ctl;
+   data->frame.buf[data->frame.len++] = lo | ctl | LCD_CS;
+   data->frame.buf[data->frame.len++] = lo | ctl;
+   return 0;
+}
+
+/* Sends single command or data byte. Function return negative if error */
 static int hd44780_i2c_send(struct i2c_client* _client, char _mode,
       char _data) {
    int ret = 0;
-   struct hd44780_data* data = i2c_get_clientdata(_client); 
-   unsigned char bl = data->backlight;
-   switch (_mode) {
-      case 0:
-         ret |= i2c_smbus_write_byte(_client, (0xf0 & _data) | bl | (LCD_CS 
-            & ~LCD_RS));
-         ret |= i2c_smbus_write_byte(_client, (0xf0 & _data) | (bl & ~LCD_CS 
-            & ~LCD_RS));
-         ret |= i2c_smbus_write_byte(_client, ((0x0f & _data) << 4) | bl 
-            | (LCD_CS & ~LCD_RS));
-         ret |= i2c_smbus_write_byte(_client, ((0x0f & _data) << 4) | (bl 
-            & ~LCD_CS & ~LCD_RS));
-      break;
-      default:
-         ret |= i2c_smbus_write_byte(_client, (0xf0 & _data) | (bl 
-            | LCD_CS | LCD_RS));
-         ret |= i2c_smbus_write_byte(_client, (0xf0 & _data) | (bl 
-            & (~LCD_CS)) | (LCD_RS));
-         ret |= i2c_smbus_write_byte(_client, ((0x0f & _data) << 4) 
-            | (bl | LCD_CS | LCD_RS));
-         ret |= i2c_smbus_write_byte(_client, ((0x0f & _data) << 4) 
-            | ((bl) & (~LCD_CS)) | (LCD_RS));
-      break;         
+   ret = hd44780_frame_put(_client, _mode, _data);
+   if (ret < 0) return ret;
+   return hd44780_frame_flush(_client);
+}
+
+/* Fixed delay used when the busy flag is not polled. It's the worst case
+taken from the datasheet. All callers run in process context, so it sleeps
+instead of spinning. */
+static void hd44780_delay(unsigned int _us) {
+   if (_us >= 1000)
+      msleep(DIV_ROUND_UP(_us, 1000));
+   else
+      usleep_range(_us, _us + _us / 4);
+}
+
+/* Reads busy flag. D4-D7 are set high, so PCF8574 quasi-bidirectional
+outputs can be pulled down by the controller. The second E pulse clocks out
+the low nibble (address counter), 4-bit interface always transfers both.
+Returns 1 when busy, 0 when ready, negative if error. */
+static int hd44780_read_busy(struct i2c_client* _client) {
+   struct hd44780_data* data = i2c_get_clientdata(_client);
+   unsigned char rd = 0xf0 | data->backlight | LCD_RW;
+   int val;
+   int ret = 0;
+   ret = hd44780_frame_put_raw(_client, rd | LCD_CS);
+   if (ret < 0) return ret;
+   ret = hd44780_frame_flush(_client);
+   if (ret < 0) return ret;
+   val = i2c_smbus_read_byte(_client);
+   ret = hd44780_frame_put_raw(_client, rd);
+   if (ret < 0) return ret;
+   ret = hd44780_frame_put_raw(_client, rd | LCD_CS);
+   if (ret < 0) return ret;
+   ret = hd44780_frame_put_raw(_client, rd);
+   if (ret < 0) return ret;
+   ret = hd44780_frame_flush(_client);
+   if (val < 0) return val;
+   if (ret < 0) return ret;
+   return (val & LCD_D7) ? 1 : 0;
+}
+
+/* Waits until the last command is executed. With busy_poll set BF is read
+back until it clears or busy_timeout_us elapses, otherwise (and when reading
+fails or times out) fixed delay _us is used. When reading fails the error is
+returned after the delay, so the caller can tell the bus is broken. */
+static int hd44780_wait_ready(struct i2c_client* _client, unsigned int _us) {
+   ktime_t start;
+   int ret = 0;
+   if (!busy_poll || !i2c_check_functionality(_client->adapter,
+         I2C_FUNC_SMBUS_READ_BYTE)) {
+      hd44780_delay(_us);
+      return 0;
    }
-   return ret;
+   start = ktime_get();
+   do {
+      ret = hd44780_read_busy(_client);
+      if (ret == 0) return 0;
+      if (ret < 0) break;
+   } while (ktime_us_delta(ktime_get(), start) < busy_timeout_us);
+   hd44780_delay(_us);
+   return (ret < 0) ? ret : 0;
 }
 
 /* Sets curor position */
@@ -140,6 +306,7 @@ static ssize_t write_backlight(struct device *dev, struct device_attribute*
    if (count < 1) {
       return -EIO;
    } else {
+      mutex_lock(&data->lock);
       switch (buf[0]) {
          case 0:
          case '0':
@@ -151,6 +318,7 @@ static ssize_t write_backlight(struct device *dev, struct device_attribute*
             data->backlight = LCD_BL;
          break;
       }
+      mutex_unlock(&data->lock);
    }
    if (ret < 0)
       return ret;
@@ -162,38 +330,48 @@ full lines and two \n). If userland wants to write more, -ENOSPACE is
 returned. After writing cursor is set to home position. Lines shorter than
 16 characters are filled with spaces to write full display. It's nessesary
 for clearing old content without CLEAR command. CLEAR command causes visible
-blinking. */
+blinking. Whole content goes to the bus as one frame. */
 static ssize_t write_content(struct device* _dev, struct device_attribute* 
    _attr, const char* _buf, size_t _count) {
    struct i2c_client* _client = to_i2c_client(_dev);
+   struct hd44780_data* data = i2c_get_clientdata(_client);
    int i, k, c;
    int ret = 0;
    unsigned char char_cnt = 0;
    if (_count > 34) return -ENOSPC;
    if (_count > 0) {
-      msleep(1);
+      mutex_lock(&data->lock);
+      ret = hd44780_wait_ready(_client, 1000);
+      if (ret < 0) goto content_error;
       for (i = 0, char_cnt = 0; i < _count; i++) {
          if (_buf[i] == '\n') {
             c = char_cnt;
             for (k = c; k <= 15; k++) {
-               ret = hd44780_i2c_send(_client, LCD_MODE_DATA, ' ');
-               if (ret < 0) return -EIO;
+               ret = hd44780_frame_put(_client, LCD_MODE_DATA, ' ');
+               if (ret < 0) goto content_error;
             }
-            ret = hd44780_i2c_send(_client, LCD_MODE_CMD, 0xC0);
-            if (ret < 0) return -EIO;
+            ret = hd44780_frame_put(_client, LCD_MODE_CMD, 0xC0);
+            if (ret < 0) goto content_error;
             char_cnt = 0;
             continue;
          } else {
-            ret = hd44780_i2c_send(_client, LCD_MODE_DATA, _buf[i]);
-            if (ret < 0) return -EIO;
+            ret = hd44780_frame_put(_client, LCD_MODE_DATA, _buf[i]);
+            if (ret < 0) goto content_error;
          }
          char_cnt++;
       }
-      hd44780_i2c_gotoxy(_client, 0, 0);
+      ret = hd44780_i2c_gotoxy(_client, 0, 0);
+      if (ret < 0) goto content_error;
+      mutex_unlock(&data->lock);
       return _count;
    } else {
       return -EIO;
    }
+
+content_error:
+   /* states not sent yet would go out with the next writer */
+   data->frame.len = 0;
+   mutex_unlock(&data->lock);
    return -EIO;
 }
 
@@ -205,6 +383,7 @@ static ssize_t write_cursor_state(struct device* _dev, struct device_attribute*
    if (_count < 1) {
       return -EIO;
    } else {
+      mutex_lock(&_data->lock);
       switch (_buf[0]) {
          case 0:
          case '0':
@@ -216,6 +395,7 @@ static ssize_t write_cursor_state(struct device* _dev, struct device_attribute*
       }
       hd44780_i2c_send(_client, LCD_MODE_CMD, 0x08 | _data->cursor_state 
       | _data->cursor_blink | _data->display_state);
+      mutex_unlock(&_data->lock);
    }
    return _count;
 }
@@ -228,6 +408,7 @@ static ssize_t write_cursor_blink(struct device* _dev, struct device_attribute*
    if (_count < 1) {
       return -EIO;
    } else {
+      mutex_lock(&_data->lock);
       switch (_buf[0]) {
          case 0:
          case '0':
@@ -239,6 +420,7 @@ static ssize_t write_cursor_blink(struct device* _dev, struct device_attribute*
       }
       hd44780_i2c_send(_client, LCD_MODE_CMD, 0x08 | _data->cursor_state 
       | _data->cursor_blink | _data->display_state);
+      mutex_unlock(&_data->lock);
    }
    return _count;
 }
@@ -251,6 +433,7 @@ static ssize_t write_display_state(struct device* _dev,
    if (_count < 1) {
       return -EIO;
    } else {
+      mutex_lock(&_data->lock);
       switch (_buf[0]) {
          case 0:
          case '0':
@@ -262,6 +445,7 @@ static ssize_t write_display_state(struct device* _dev,
       }
       hd44780_i2c_send(_client, LCD_MODE_CMD, 0x08 | _data->cursor_state 
       | _data->cursor_blink | _data->display_state);
+      mutex_unlock(&_data->lock);
    }
    return _count;
 }
@@ -270,6 +454,7 @@ static ssize_t write_display_state(struct device* _dev,
 static ssize_t write_display_clear(struct device* _dev,
    struct device_attribute* _attr, const char* _buf, size_t _count) {
    struct i2c_client* _client = to_i2c_client(_dev);
+   struct hd44780_data* data = i2c_get_clientdata(_client);
    int ret = 0;
    if (_count < 1) {
       return -EIO;
@@ -279,7 +464,9 @@ static ssize_t write_display_clear(struct device* _dev,
          case '0':
             break;
          default:
+            mutex_lock(&data->lock);
             ret = hd44780_i2c_send(_client, LCD_MODE_CMD, 0x1);
+            mutex_unlock(&data->lock);
             if (ret < 0) return -EIO;
             break;
       }
@@ -294,41 +481,51 @@ DEVICE_ATTR(cursor_blink, 0220, NULL, write_cursor_blink);
 DEVICE_ATTR(display_state, 0200, NULL, write_display_state);
 DEVICE_ATTR(display_clear, 0200, NULL, write_display_clear);
 
+/* Single E pulse with given nibble, used while controller is still in 8-bit
+mode. Both output states go in one transaction. */
+static int hd44780_init_nibble(struct i2c_client* _client,
+      unsigned char _nibble) {
+   int ret = 0;
+   ret = hd44780_frame_put_raw(_client, _nibble | LCD_CS);
+   if (ret < 0) return ret;
+   ret = hd44780_frame_put_raw(_client, _nibble & ~LCD_CS);
+   if (ret < 0) return ret;
+   return hd44780_frame_flush(_client);
+}
+
 /* Typical initialization procedure of hd44780 with 4-bit interface */
 static int hd44780_i2c_init(struct i2c_client* _client) {
    int ret = 0;
-   ret = i2c_smbus_write_byte(_client, 0x30 | LCD_CS);
-   if (ret < 0) goto init_error;
-   ret = i2c_smbus_write_byte(_client, 0x30 & ~LCD_CS);
+   ret = hd44780_init_nibble(_client, 0x30);
    if (ret < 0) goto init_error;
    msleep(5);
-   ret = i2c_smbus_write_byte(_client, 0x30 | LCD_CS);
-   if (ret < 0) goto init_error;
-   ret = i2c_smbus_write_byte(_client, 0x30 & ~LCD_CS);
+   ret = hd44780_init_nibble(_client, 0x30);
    if (ret < 0) goto init_error;
-   udelay(200);
-   ret = i2c_smbus_write_byte(_client, 0x30 | LCD_CS);
+   hd44780_delay(200);
+   ret = hd44780_init_nibble(_client, 0x30);
    if (ret < 0) goto init_error;
-   ret = i2c_smbus_write_byte(_client, 0x30 & ~LCD_CS);
+   hd44780_delay(200);
+   ret = hd44780_init_nibble(_client, 0x20);
    if (ret < 0) goto init_error;
-   udelay(200);
-   ret = i2c_smbus_write_byte(_client, 0x20 | LCD_CS);
+   /* 4-bit interface is set, busy flag can be used from now on */
+   ret = hd44780_wait_ready(_client, 700);
    if (ret < 0) goto init_error;
-   ret = i2c_smbus_write_byte(_client, 0x20 & ~LCD_CS);
-   if (ret < 0) goto init_error;
-   udelay(700);
    ret = hd44780_i2c_send(_client, LCD_MODE_CMD, 0x28);
    if (ret < 0) goto init_error;
-   udelay(700);
+   ret = hd44780_wait_ready(_client, 700);
+   if (ret < 0) goto init_error;
    ret = hd44780_i2c_send(_client, LCD_MODE_CMD, 0x08);
    if (ret < 0) goto init_error;
-   udelay(700);
+   ret = hd44780_wait_ready(_client, 700);
+   if (ret < 0) goto init_error;
    ret = hd44780_i2c_send(_client, LCD_MODE_CMD, 0x01);
    if (ret < 0) goto init_error;
-   udelay(700);
+   ret = hd44780_wait_ready(_client, 700);
+   if (ret < 0) goto init_error;
    ret = hd44780_i2c_send(_client, LCD_MODE_CMD, 0x06);
    if (ret < 0) goto init_error;
-   udelay(700);
+   ret = hd44780_wait_ready(_client, 700);
+   if (ret < 0) goto init_error;
    ret = hd44780_i2c_send(_client, LCD_MODE_CMD, 0x0E);
    if (ret < 0) goto init_error;
    return 0;
@@ -348,10 +545,12 @@ static int hd44780_i2c_deinit(struct i2c_client* _client) {
    ret = hd44780_i2c_send(_client, LCD_MODE_CMD, 0x01);
    if (ret < 0) goto deinit_error;
    //off display, off cursor
-   msleep(1);
+   ret = hd44780_wait_ready(_client, 1000);
+   if (ret < 0) goto deinit_error;
    ret = hd44780_i2c_send(_client, LCD_MODE_CMD, 0x08);
    if (ret < 0) goto deinit_error;
-   msleep(1);
+   ret = hd44780_wait_ready(_client, 1000);
+   if (ret < 0) goto deinit_error;
    ret = i2c_smbus_write_byte(_client, (0xf0 | (LCD_CS & ~LCD_BL)));
    if (ret < 0) goto deinit_error;
    return 0;
@@ -380,8 +579,12 @@ static int hd44780_i2c_probe(struct i2c_client* _client,
    data->cursor_state = 0;
    data->cursor_blink = 0;
    data->display_state = 1;
+   mutex_init(&data->lock);
    i2c_set_clientdata(_client, data);
+   /* no writers yet, lock keeps helpers called as documented */
+   mutex_lock(&data->lock);
    ret = hd44780_i2c_init(_client);
+   mutex_unlock(&data->lock);
    if (ret < 0) goto probe_error;
    ret = device_create_file(dev, &dev_attr_backlight);
    if (ret < 0) goto probe_error;
@@ -405,8 +608,11 @@ probe_error:
 
 /* Deinitiazation on remove */
 static int hd44780_i2c_remove(struct i2c_client* _client) {
+   struct hd44780_data* data = i2c_get_clientdata(_client);
    int ret = 0;
+   mutex_lock(&data->lock);
    ret = hd44780_i2c_deinit(_client);
+   mutex_unlock(&data->lock);
    if (ret < 0) {
       dev_err(&_client->dev, "lcd_drv: Error while removing device, \
          errno %d\n", ret);
@@ -415,27 +621,51 @@ static int hd44780_i2c_remove(struct i2c_client* _client) {
    return 0;
 }
 
+/* Creates displays given by module parameters. Without any, the single
+display at bus 1, address 0x27 is created, as it always was. Each display
+keeps its state in its own client data. */
+static void hd44780_create_clients(void) {
+   struct i2c_board_info info = {
+      .type = "hd44780_i2c",
+   };
+   struct i2c_adapter* adapter;
+   int count = max(max(bus_num, addr_num), 1);
+   int nr;
+   int i;
+   for (i = 0; i < count; i++) {
+      nr = (i < bus_num) ? bus[i] : 1;
+      info.addr = (i < addr_num) ? addr[i] : 0x27;
+      adapter = i2c_get_adapter(nr);
+      if (!adapter) {
+         printk(KERN_ERR "lcd_drv: Error while getting i2c adapter %d\n",
+            nr);
+         continue;
+      }
+      lcd_clients[i] = i2c_new_device(adapter, &info);
+      if (!lcd_clients[i]) {
+         printk(KERN_ERR "lcd_drv: Error while adding device 0x%02x\n",
+            info.addr);
+      }
+      i2c_put_adapter(adapter);
+   }
+}
+
 static int hd44780_i2c_driver_init(void) {
-   struct i2c_adapter *adapter = NULL;
    int ret = 0;
-   adapter = i2c_get_adapter(1);
-   if (!adapter) {
-      printk(KERN_ERR "lcd_drv: Error while getting i2c adapter\n");
-      return -ENODEV;
-   }
-   client = i2c_new_device(adapter, &info);
-   if (!client) {
-      printk(KERN_ERR "lcd_drv: Error while adding device\n");
-   }
    ret = i2c_add_driver(&hd44780_i2c_driver);   
    if (ret < 0) {
       printk(KERN_ERR "lcd_drv: Error while adding driver, errno: %d", ret);
+      return ret;
    }
+   hd44780_create_clients();
    return 0;
 }
 
 static void hd44780_i2c_driver_exit(void) {
-   i2c_unregister_device(client);
+   int i;
+   for (i = 0; i < LCD_MAX_DEVICES; i++) {
+      if (lcd_clients[i]) i2c_unregister_device(lcd_clients[i]);
+   }
    i2c_del_driver(&hd44780_i2c_driver);
 
 }
@@ -0,0 +1,474 @@
+#include <linux/module.h>
+#include <linux/init.h>
+#include <linux/slab.h>
+#include <linux/i2c.h>
+#include <linux/err.h>
+#include <linux/mutex.h>
+#include <linux/delay.h>
+#include <linux/ktime.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+
+MODULE_AUTHOR("Marcin Kłos");
+MODULE_DESCRIPTION("Emulated HD44780 with PCF8574 on virtual I2C bus");
+MODULE_LICENSE("GPL");
+
+/* Emulator of HD44780 behind PCF8574, for testing lcd_drv and lcd_hdpcf
+without hardware. Virtual I2C adapter is registered and the expander answers
+at addr. Every byte written is an output state of PCF8574 and the controller
+latches nibbles on falling edge of E, as the real one does. DDRAM, CGRAM,
+address counter and busy time of every instruction are modeled. Result is
+shown in debugfs:
+   lcd_emu/display   visible content, rows lines of cols characters, '?'
+                     for codes not in printable ASCII
+   lcd_emu/ddram     whole DDRAM, hex
+   lcd_emu/cgram     CGRAM, hex
+   lcd_emu/state     controller state and bus counters
+Example:
+   insmod lcd_emu.ko bus=11
+   insmod lcd_hdpcf.ko bus=11
+   cat /sys/kernel/debug/lcd_emu/display */
+
+/* PCF8574 pins, the same wiring as in the drivers */
+#define LCD_RS             0x01
+#define LCD_RW             0x02
+#define LCD_CS             0x04
+#define LCD_BL             0x08
+
+/* Execution times from the datasheet (fosc = 270 kHz) */
+#define EMU_EXEC_US        37
+#define EMU_DATA_US        41
+#define EMU_HOME_US        1520
+
+#define EMU_LINE_LEN       40
+
+static int bus = -1;
+module_param(bus, int, 0444);
+MODULE_PARM_DESC(bus, "I2C bus number of the emulated adapter, -1 for "
+   "any free one (default: -1)");
+
+static unsigned short addr = 0x27;
+module_param(addr, ushort, 0444);
+MODULE_PARM_DESC(addr, "I2C address of the emulated PCF8574 (default: 0x27)");
+
+static unsigned int cols = 16;
+module_param(cols, uint, 0444);
+MODULE_PARM_DESC(cols, "Visible columns (default: 16)");
+
+static unsigned int rows = 2;
+module_param(rows, uint, 0444);
+MODULE_PARM_DESC(rows, "Visible rows, 1, 2 or 4 (default: 2)");
+
+/* Bus speed decides how much time passes between PCF8574 output states and
+so whether the controller is still busy when the next nibble comes. Transfer
+also takes that long. 0 means infinitely fast bus, then back to back writes
+are counted as violations. */
+static unsigned int bus_khz = 100;
+module_param(bus_khz, uint, 0644);
+MODULE_PARM_DESC(bus_khz, "Emulated I2C clock in kHz, 0 for no transfer "
+   "time (default: 100)");
+
+static bool strict;
+module_param(strict, bool, 0644);
+MODULE_PARM_DESC(strict, "Drop instructions written while busy, as real "
+   "controller does (default: 0)");
+
+struct lcd_emu {
+   struct i2c_adapter adapter;
+   struct mutex lock;
+   struct dentry* debugfs;
+   /* Emulated time of the byte being processed */
+   ktime_t now;
+   /* PCF8574 output latch */
+   unsigned char latch;
+   /* HD44780 interface state */
+   bool mode4;
+   bool low_nibble;
+   unsigned char nibble;
+   bool read_low;
+   /* HD44780 memory and registers */
+   unsigned char ddram[2 * EMU_LINE_LEN];
+   unsigned char cgram[64];
+   unsigned char ac;
+   bool cgram_sel;
+   bool increment;
+   bool shift_on_write;
+   bool display;
+   bool cursor;
+   bool blink;
+   bool two_lines;
+   int shift;
+   ktime_t busy_until;
+   /* counters */
+   unsigned long bytes;
+   unsigned long transactions;
+   unsigned long commands;
+   unsigned long writes;
+   unsigned long reads;
+   unsigned long violations;
+};
+
+static struct lcd_emu* emu;
+
+/* DDRAM address to index in ddram[]. Addresses between lines are not
+defined by the datasheet, they wrap inside the line here. */
+static int emu_ddram_index(unsigned char _ac) {
+   if (_ac >= 0x40) return EMU_LINE_LEN + (_ac - 0x40) % EMU_LINE_LEN;
+   return _ac % EMU_LINE_LEN;
+}
+
+static bool emu_busy(struct lcd_emu* _e) {
+   return ktime_before(_e->now, _e->busy_until);
+}
+
+static void emu_set_busy(struct lcd_emu* _e, unsigned int _us) {
+   _e->busy_until = ktime_add_us(_e->now, _us);
+}
+
+/* Moves address counter after data access. DDRAM line ends at 0x27 and
+0x67, counter jumps to the next line. */
+static void emu_ac_step(struct lcd_emu* _e) {
+   if (_e->cgram_sel) {
+      _e->ac = (_e->ac + (_e->increment ? 1 : -1)) & 0x3f;
+      return;
+   }
+   if (_e->increment) {
+      _e->ac++;
+      if (_e->ac == 0x28) _e->ac = 0x40;
+      else if (_e->ac >= 0x68) _e->ac = 0x00;
+   } else {
+      if (_e->ac == 0x00) _e->ac = 0x67;
+      else if (_e->ac == 0x40) _e->ac = 0x27;
+      else _e->ac--;
+   }
+}
+
+static void emu_shift_display(struct lcd_emu* _e, bool _right) {
+   _e->shift = (_e->shift + (_right ? EMU_LINE_LEN - 1 : 1)) % EMU_LINE_LEN;
+}
+
+static void emu_command(struct lcd_emu* _e, unsigned char _cmd) {
+   _e->commands++;
+   emu_set_busy(_e, EMU_EXEC_US);
+   if (_cmd & 0x80) {
+      _e->ac = _cmd & 0x7f;
+      _e->cgram_sel = false;
+   } else if (_cmd & 0x40) {
+      _e->ac = _cmd & 0x3f;
+      _e->cgram_sel = true;
+   } else if (_cmd & 0x20) {
+      _e->mode4 = !(_cmd & 0x10);
+      _e->two_lines = _cmd & 0x08;
+      _e->low_nibble = false;
+   } else if (_cmd & 0x10) {
+      if (_cmd & 0x08) {
+         emu_shift_display(_e, _cmd & 0x04);
+      } else {
+         /* the same wrapping as for data, direction given by R/L */
+         bool increment = _e->increment;
+         _e->increment = _cmd & 0x04;
+         emu_ac_step(_e);
+         _e->increment = increment;
+      }
+   } else if (_cmd & 0x08) {
+      _e->display = _cmd & 0x04;
+      _e->cursor = _cmd & 0x02;
+      _e->blink = _cmd & 0x01;
+   } else if (_cmd & 0x04) {
+      _e->increment = _cmd & 0x02;
+      _e->shift_on_write = _cmd & 0x01;
+   } else if (_cmd & 0x02) {
+      _e->ac = 0;
+      _e->cgram_sel = false;
+      _e->shift = 0;
+      emu_set_busy(_e, EMU_HOME_US);
+   } else if (_cmd & 0x01) {
+      memset(_e->ddram, ' ', sizeof(_e->ddram));
+      _e->ac = 0;
+      _e->cgram_sel = false;
+      _e->shift = 0;
+      _e->increment = true;
+      emu_set_busy(_e, EMU_HOME_US);
+   }
+}
+
+static void emu_data(struct lcd_emu* _e, unsigned char _data) {
+   _e->writes++;
+   emu_set_busy(_e, EMU_DATA_US);
+   if (_e->cgram_sel) {
+      _e->cgram[_e->ac & 0x3f] = _data & 0x1f;
+   } else {
+      _e->ddram[emu_ddram_index(_e->ac)] = _data;
+      if (_e->shift_on_write) emu_shift_display(_e, !_e->increment);
+   }
+   emu_ac_step(_e);
+}
+
+/* Whole instruction or data byte arrived */
+static void emu_byte(struct lcd_emu* _e, bool _rs, unsigned char _byte) {
+   if (emu_busy(_e)) {
+      _e->violations++;
+      if (strict) return;
+   }
+   if (_rs)
+      emu_data(_e, _byte);
+   else
+      emu_command(_e, _byte);
+}
+
+/* Nibble on D4-D7 latched by falling edge of E. In 8-bit mode D0-D3 are not
+connected and read as 0. */
+static void emu_nibble(struct lcd_emu* _e, bool _rs, unsigned char _hi) {
+   /* the instruction switching to 4-bit mode comes as single nibble */
+   if (!_e->mode4) {
+      emu_byte(_e, _rs, _hi);
+      return;
+   }
+   if (!_e->low_nibble) {
+      _e->nibble = _hi;
+      _e->low_nibble = true;
+      return;
+   }
+   _e->low_nibble = false;
+   emu_byte(_e, _rs, _e->nibble | (_hi >> 4));
+}
+
+/* Register put on D0-D7 by the controller while reading */
+static unsigned char emu_read_reg(struct lcd_emu* _e, bool _rs) {
+   if (!_rs)
+      return (emu_busy(_e) ? 0x80 : 0) | (_e->ac & 0x7f);
+   if (_e->cgram_sel) return _e->cgram[_e->ac & 0x3f];
+   return _e->ddram[emu_ddram_index(_e->ac)];
+}
+
+/* New PCF8574 output state */
+static void emu_latch(struct lcd_emu* _e, unsigned char _state) {
+   unsigned char prev = _e->latch;
+   _e->latch = _state;
+   if (!(prev & LCD_CS) || (_state & LCD_CS)) return;
+   if (!(prev & LCD_RW)) {
+      emu_nibble(_e, prev & LCD_RS, prev & 0xf0);
+      return;
+   }
+   /* end of read cycle, data read moves the address counter */
+   if (_e->mode4 && !_e->read_low) {
+      _e->read_low = true;
+      return;
+   }
+   _e->read_low = false;
+   _e->reads++;
+   if (prev & LCD_RS) emu_ac_step(_e);
+}
+
+/* PCF8574 pins as read back. Quasi-bidirectional outputs set high can be
+pulled down by the controller, which drives D4-D7 while E and RW are high. */
+static unsigned char emu_pins(struct lcd_emu* _e) {
+   unsigned char reg;
+   if ((_e->latch & (LCD_RW | LCD_CS)) != (LCD_RW | LCD_CS))
+      return _e->latch;
+   reg = emu_read_reg(_e, _e->latch & LCD_RS);
+   reg = (_e->read_low) ? (reg << 4) : (reg & 0xf0);
+   return (_e->latch & 0x0f) | (_e->latch & reg & 0xf0);
+}
+
+/* Time of one byte on the bus, 8 bits and ACK */
+static s64 emu_byte_ns(void) {
+   if (!bus_khz) return 0;
+   return div_u64(9ULL * NSEC_PER_MSEC, bus_khz);
+}
+
+static int emu_xfer(struct i2c_adapter* _adap, struct i2c_msg* _msgs,
+      int _num) {
+   struct lcd_emu* e = i2c_get_adapdata(_adap);
+   s64 byte_ns = emu_byte_ns();
+   s64 us;
+   int i, j;
+   mutex_lock(&e->lock);
+   e->now = ktime_get();
+   for (i = 0; i < _num; i++) {
+      if (_msgs[i].addr != addr) {
+         mutex_unlock(&e->lock);
+         return -ENXIO;
+      }
+      /* address byte */
+      e->now = ktime_add_ns(e->now, byte_ns);
+      for (j = 0; j < _msgs[i].len; j++) {
+         e->now = ktime_add_ns(e->now, byte_ns);
+         if (_msgs[i].flags & I2C_M_RD)
+            _msgs[i].buf[j] = emu_pins(e);
+         else
+            emu_latch(e, _msgs[i].buf[j]);
+      }
+      e->bytes += _msgs[i].len;
+      e->transactions++;
+   }
+   us = ktime_us_delta(e->now, ktime_get());
+   mutex_unlock(&e->lock);
+   /* transfer takes as long as on the real bus */
+   if (us >= 20)
+      usleep_range(us, us + us / 8);
+   else if (us > 0)
+      udelay(us);
+   return _num;
+}
+
+static u32 emu_func(struct i2c_adapter* _adap) {
+   return I2C_FUNC_I2C | I2C_FUNC_SMBUS_EMUL;
+}
+
+static const struct i2c_algorithm emu_algo = {
+   .master_xfer = emu_xfer,
+   .functionality = emu_func,
+};
+
+/* Power-on state after internal reset: 8-bit interface, display off,
+DDRAM cleared, increment mode. PCF8574 outputs are high. */
+static void emu_reset(struct lcd_emu* _e) {
+   _e->latch = 0xff;
+   _e->mode4 = false;
+   _e->low_nibble = false;
+   _e->read_low = false;
+   memset(_e->ddram, ' ', sizeof(_e->ddram));
+   memset(_e->cgram, 0, sizeof(_e->cgram));
+   _e->ac = 0;
+   _e->cgram_sel = false;
+   _e->increment = true;
+   _e->shift_on_write = false;
+   _e->display = false;
+   _e->cursor = false;
+   _e->blink = false;
+   _e->two_lines = false;
+   _e->shift = 0;
+   _e->busy_until = ktime_get();
+}
+
+/* DDRAM address of the first character of visible row. 4-line modules are
+two long lines folded, 16x4 and 20x4 start rows 2 and 3 at cols. */
+static unsigned char emu_row_addr(unsigned int _row) {
+   static const unsigned char base[4] = { 0x00, 0x40, 0x00, 0x40 };
+   return base[_row] + ((_row >= 2) ? cols : 0);
+}
+
+/* What would be seen, blank when display is off. Codes outside printable
+ASCII (CGRAM characters 0x00 - 0x0f, ROM characters from 0x80) are shown as
+'?', their values are in ddram. */
+static int emu_display_show(struct seq_file* _m, void* _v) {
+   struct lcd_emu* e = _m->private;
+   unsigned char a, ch;
+   unsigned int r, c;
+   mutex_lock(&e->lock);
+   for (r = 0; r < min(rows, 4U); r++) {
+      for (c = 0; c < cols; c++) {
+         a = emu_row_addr(r);
+         a = (a & 0x40) | (((a & 0x3f) + c + e->shift) % EMU_LINE_LEN);
+         ch = e->display ? e->ddram[emu_ddram_index(a)] : ' ';
+         seq_putc(_m, (ch >= 0x20 && ch < 0x7f) ? ch : '?');
+      }
+      seq_putc(_m, '\n');
+   }
+   mutex_unlock(&e->lock);
+   return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(emu_display);
+
+static int emu_ddram_show(struct seq_file* _m, void* _v) {
+   struct lcd_emu* e = _m->private;
+   int i;
+   mutex_lock(&e->lock);
+   for (i = 0; i < sizeof(e->ddram); i++) {
+      seq_printf(_m, "%02x", e->ddram[i]);
+      seq_putc(_m, ((i + 1) % EMU_LINE_LEN) ? ' ' : '\n');
+   }
+   mutex_unlock(&e->lock);
+   return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(emu_ddram);
+
+static int emu_cgram_show(struct seq_file* _m, void* _v) {
+   struct lcd_emu* e = _m->private;
+   int i;
+   mutex_lock(&e->lock);
+   for (i = 0; i < sizeof(e->cgram); i++) {
+      seq_printf(_m, "%02x", e->cgram[i]);
+      seq_putc(_m, ((i + 1) % 8) ? ' ' : '\n');
+   }
+   mutex_unlock(&e->lock);
+   return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(emu_cgram);
+
+/* One "name value" pair per line */
+static int emu_state_show(struct seq_file* _m, void* _v) {
+   struct lcd_emu* e = _m->private;
+   mutex_lock(&e->lock);
+   e->now = ktime_get();
+   seq_printf(_m, "interface %d\n", e->mode4 ? 4 : 8);
+   seq_printf(_m, "lines %d\n", e->two_lines ? 2 : 1);
+   seq_printf(_m, "ac 0x%02x\n", e->ac);
+   seq_printf(_m, "cgram_selected %d\n", e->cgram_sel);
+   seq_printf(_m, "increment %d\n", e->increment);
+   seq_printf(_m, "shift_on_write %d\n", e->shift_on_write);
+   seq_printf(_m, "display %d\n", e->display);
+   seq_printf(_m, "cursor %d\n", e->cursor);
+   seq_printf(_m, "blink %d\n", e->blink);
+   seq_printf(_m, "backlight %d\n", !!(e->latch & LCD_BL));
+   seq_printf(_m, "shift %d\n", e->shift);
+   seq_printf(_m, "busy %d\n", emu_busy(e));
+   seq_printf(_m, "bytes %lu\n", e->bytes);
+   seq_printf(_m, "transactions %lu\n", e->transactions);
+   seq_printf(_m, "commands %lu\n", e->commands);
+   seq_printf(_m, "writes %lu\n", e->writes);
+   seq_printf(_m, "reads %lu\n", e->reads);
+   seq_printf(_m, "violations %lu\n", e->violations);
+   mutex_unlock(&e->lock);
+   return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(emu_state);
+
+static int lcd_emu_init(void) {
+   int ret = 0;
+   if (rows != 1 && rows != 2 && rows != 4) return -EINVAL;
+   if (cols == 0 || cols > EMU_LINE_LEN || (rows == 4 && cols > 20))
+      return -EINVAL;
+   emu = kzalloc(sizeof(*emu), GFP_KERNEL);
+   if (!emu) return -ENOMEM;
+   mutex_init(&emu->lock);
+   emu_reset(emu);
+   emu->adapter.owner = THIS_MODULE;
+   emu->adapter.class = I2C_CLASS_HWMON;
+   emu->adapter.algo = &emu_algo;
+   snprintf(emu->adapter.name, sizeof(emu->adapter.name),
+      "HD44780/PCF8574 emulator");
+   i2c_set_adapdata(&emu->adapter, emu);
+   if (bus >= 0) {
+      emu->adapter.nr = bus;
+      ret = i2c_add_numbered_adapter(&emu->adapter);
+   } else {
+      ret = i2c_add_adapter(&emu->adapter);
+   }
+   if (ret < 0) {
+      printk(KERN_ERR "lcd_emu: Error while adding adapter, errno: %d\n",
+         ret);
+      kfree(emu);
+      return ret;
+   }
+   /* debugfs is not essential, errors are ignored */
+   emu->debugfs = debugfs_create_dir("lcd_emu", NULL);
+   debugfs_create_file("display", 0444, emu->debugfs, emu,
+      &emu_display_fops);
+   debugfs_create_file("ddram", 0444, emu->debugfs, emu, &emu_ddram_fops);
+   debugfs_create_file("cgram", 0444, emu->debugfs, emu, &emu_cgram_fops);
+   debugfs_create_file("state", 0444, emu->debugfs, emu, &emu_state_fops);
+   printk(KERN_INFO "lcd_emu: PCF8574 at %d-%04x\n", emu->adapter.nr, addr);
+   return 0;
+}
+
+static void lcd_emu_exit(void) {
+   debugfs_remove_recursive(emu->debugfs);
+   i2c_del_adapter(&emu->adapter);
+   kfree(emu);
+   printk(KERN_INFO "lcd_emu: unloaded.\n");
+}
+
+module_init(lcd_emu_init);
+module_exit(lcd_emu_exit);
@@ -11,13 +11,29 @@
 #include <linux/interrupt.h>
 #include <linux/regulator/consumer.h>
 #include <linux/delay.h>
+#include <linux/ktime.h>
 #include <linux/cdev.h>
 #include <linux/kdev_t.h>
 #include <linux/fs.h>
 #include <linux/device.h>
+#include <linux/uaccess.h>
+#include <linux/workqueue.h>
+#include <linux/mm.h>
+#include <linux/kref.h>
+#include <linux/of.h>
+#include <linux/spinlock.h>
+#include <linux/wait.h>
+#include <linux/percpu.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/hrtimer.h>
+#include <linux/compat.h>
 
 #include "lcd_hdpcf.h"
 
+#define CREATE_TRACE_POINTS
+#include "lcd_hdpcf_trace.h"
+
 MODULE_AUTHOR("Marcin Kłos");
 MODULE_DESCRIPTION("HD44780 on I2C (with PCF8574T gpio expander)");
 MODULE_LICENSE("GPL");
@@ -41,6 +57,75 @@ MODULE_LICENSE("GPL");
 #define LCD_CURSOR_BLINK   0x01
 #define LCD_DISPLAY        0x04
 
+/* HD44780 busy flag can be read back through PCF8574 (LCD_RW line). When
+enabled, commands wait for the controller instead of worst case delays, which
+remain as fallback. */
+static bool busy_poll;
+module_param(busy_poll, bool, 0644);
+MODULE_PARM_DESC(busy_poll, "Poll HD44780 busy flag instead of fixed delays "
+   "(default: 0)");
+
+static unsigned int busy_timeout_us = 10000;
+module_param(busy_timeout_us, uint, 0644);
+MODULE_PARM_DESC(busy_timeout_us, "Busy flag polling timeout in us, fixed "
+   "delay is used after it (default: 10000)");
+
+/* Command execution times are measured with the busy flag after init and
+stored in the timing profile of the display, see hdpcf_calibrate_locked().
+Profile can be changed in /sys/class/hdpcf/hdpcfN/timing. */
+static bool calibrate;
+module_param(calibrate, bool, 0444);
+MODULE_PARM_DESC(calibrate, "Measure command execution times at probe "
+   "(default: 0)");
+
+/* Work waiting for the bus, see hdpcf_flush_locked() */
+#define HDPCF_PENDING_CLEAR      0x01
+#define HDPCF_PENDING_STATE      0x02
+#define HDPCF_PENDING_DISPLAY    0x04
+#define HDPCF_PENDING_SHIFT      0x08
+#define HDPCF_PENDING_CGRAM      0x10
+#define HDPCF_PENDING_CURSOR     0x20
+#define HDPCF_PENDING_SCROLL     0x40
+
+/* In asynchronous mode IOCTL_LCD_UPDATE_DISPLAY and IOCTL_LCD_UPDATE_STATE
+only store the request and return. Bus I/O is done later by a work item and
+requests arriving in the meantime are merged into one write. */
+static bool async_flush;
+module_param(async_flush, bool, 0644);
+MODULE_PARM_DESC(async_flush, "Return from update ioctls before bus I/O "
+   "is done (default: 0)");
+
+/* Page shared with userland by mmap() is scanned in this interval and
+changes are flushed in the background. 0 means that only IOCTL_LCD_MMAP_FLUSH
+picks the page up. */
+static unsigned int mmap_poll_ms = 40;
+module_param(mmap_poll_ms, uint, 0644);
+MODULE_PARM_DESC(mmap_poll_ms, "Scan interval of the mmap() page in ms, 0 "
+   "disables scanning (default: 40)");
+
+/* Flush of normal content is put on the bus in pieces of this many
+characters and gives way to high priority requests between them, see
+IOCTL_LCD_SET_PRIO. Smaller pieces mean shorter wait of high priority
+content and a bit more bus overhead. */
+static unsigned int preempt_cells = 8;
+module_param(preempt_cells, uint, 0644);
+MODULE_PARM_DESC(preempt_cells, "Characters written between checks for high "
+   "priority requests, 0 disables preemption (default: 8)");
+
+/* After this many preemptions the flush of normal content goes on to the end
+without giving way, so a steady stream of high priority requests can't keep
+normal content and its synchronous callers waiting forever. */
+static unsigned int preempt_max = 4;
+module_param(preempt_max, uint, 0644);
+MODULE_PARM_DESC(preempt_max, "Preemptions of one flush before normal "
+   "content is finished without giving way (default: 4)");
+
+/* Size of glyph registry of each display, see IOCTL_LCD_GLYPH_DEFINE */
+static unsigned int max_glyphs = 256;
+module_param(max_glyphs, uint, 0444);
+MODULE_PARM_DESC(max_glyphs, "Number of glyphs, which can be defined for "
+   "each display (default: 256)");
+
 static int hd44780_i2c_probe(struct i2c_client* _client,
       const struct i2c_device_id* _id);
 static int hd44780_i2c_remove(struct i2c_client* _client);
@@ -48,27 +133,327 @@ static int hd44780_i2c_remove(struct i2c_client* _client);
 /* --- */
 
 /* Typicaly i2c to hd44780 module uses PCF8475T with address
-   0x27. User has to take care to modify this driver, when
-   address is different. Usually A0, A1 and A2 address lines
-   are set by resistors on pcb. */
+   0x27. Usually A0, A1 and A2 address lines are set by resistors
+   on pcb. Displays at other addresses or buses are given by bus
+   and addr module parameters or by the device tree. */
 static const unsigned short normal_i2c[] = { 0x27, I2C_CLIENT_END };
 
+/* Each display gets its own /dev/hdpcfN, N is the minor number */
+#define HDPCF_MAX_DEVICES  16
+
+static unsigned short bus[HDPCF_MAX_DEVICES];
+static int bus_num;
+module_param_array(bus, ushort, &bus_num, 0444);
+MODULE_PARM_DESC(bus, "I2C bus numbers of displays created at load time "
+   "(default: 1)");
+
+static unsigned short addr[HDPCF_MAX_DEVICES];
+static int addr_num;
+module_param_array(addr, ushort, &addr_num, 0444);
+MODULE_PARM_DESC(addr, "I2C addresses of displays, one for each bus entry "
+   "(default: 0x27)");
+
+/* Geometry of displays created from module parameters, given as COLSxROWS.
+Displays from the device tree use columns and rows properties. */
+static char* geometry[HDPCF_MAX_DEVICES];
+static int geometry_num;
+module_param_array(geometry, charp, &geometry_num, 0444);
+MODULE_PARM_DESC(geometry, "Geometry of displays, one for each bus entry: "
+   "16x2, 20x2, 40x2, 16x4 or 20x4 (default: 16x2)");
+
+/* Supported modules, all driven by single HD44780 in two-line mode. DDRAM
+has two lines of 40 characters at 0x00 and 0x40, four-line modules show the
+rest of each DDRAM line as the third and the fourth row. */
+struct hdpcf_geometry {
+   unsigned char cols;
+   unsigned char rows;
+   unsigned char row_offset[LCD_MAX_ROWS];
+};
+
+static const struct hdpcf_geometry hdpcf_geometries[] = {
+   { 16, 2, { 0x00, 0x40 } },
+   { 20, 2, { 0x00, 0x40 } },
+   { 40, 2, { 0x00, 0x40 } },
+   { 16, 4, { 0x00, 0x40, 0x10, 0x50 } },
+   { 20, 4, { 0x00, 0x40, 0x14, 0x54 } },
+};
+
 static const struct i2c_device_id lcd_id[] = {
    { "hdpcf", 0 },
    { }
 };
 MODULE_DEVICE_TABLE(i2c, lcd_id);
 
-struct i2c_board_info info = {
-   .type = "hdpcf",
-   .addr = 0x27,
+static const struct of_device_id lcd_of_match[] = {
+   { .compatible = "mklos,hdpcf" },
+   { }
+};
+MODULE_DEVICE_TABLE(of, lcd_of_match);
+
+/* Clients created from module parameters, unregistered on exit */
+static struct i2c_client* hdpcf_clients[HDPCF_MAX_DEVICES];
+
+/* Frame encoder. Every HD44780 write in 4-bit mode costs four PCF8574 output
+states: high nibble with E high, the same with E low and then the same for
+the low nibble. Instead of a separate SMBus transaction for each state, the
+states are collected in a frame and put on the bus with as few messages as the
+adapter accepts. PCF8574 latches every byte of a write transaction on its
+outputs, so the waveform on the LCD pins stays the same. Full frame is
+flushed automatically, so callers don't have to care about its size. */
+#define LCD_FRAME_SIZE     256
+
+/* SMBus I2C block write carries a command byte and up to 32 data bytes. For
+PCF8574 the command byte is just one more output state. */
+#define LCD_SMBUS_CHUNK    (I2C_SMBUS_BLOCK_MAX + 1)
+
+struct hd44780_frame {
+   unsigned char buf[LCD_FRAME_SIZE];
+   int len;
+   /* DDRAM cells written by the frame, for tracing */
+   int cells;
+};
+
+/* Statistics shown in debugfs, hdpcf/hdpcfN/stats and hdpcf/hdpcfN/latency.
+Counters are per-CPU and summed only when read, so the hot path costs a
+single local increment. Latency of UPDATE_DISPLAY, CLEAR and SET_CHAR ioctls
+is kept in log2 buckets of us, bucket n counts requests shorter than 2^n us.
+So is the time from queuing to the LCD of each priority class, one sample
+per flush for the oldest request of the class in it. Counters are unsigned
+long, so they are read without tearing on 32-bit CPUs too. */
+#define HDPCF_IOCTLS       (LCD_SET_PRIO + 1)
+#define HDPCF_HIST_BUCKETS 24
+
+enum hdpcf_hist {
+   HDPCF_HIST_UPDATE_DISPLAY,
+   HDPCF_HIST_CLEAR,
+   HDPCF_HIST_SET_CHAR,
+   HDPCF_HIST_LANE_NORMAL,
+   HDPCF_HIST_LANE_HIGH,
+   HDPCF_HISTS,
+};
+
+struct hdpcf_stats {
+   unsigned long ioctls[HDPCF_IOCTLS];
+   unsigned long bytes;
+   unsigned long transactions;
+   unsigned long i2c_errors;
+   unsigned long busy_retries;
+   unsigned long busy_timeouts;
+   unsigned long cells_written;
+   unsigned long cells_skipped;
+   unsigned long cgram_uploads;
+   unsigned long cgram_skipped;
+   unsigned long preemptions;
+   unsigned long hist[HDPCF_HISTS][HDPCF_HIST_BUCKETS];
+};
+
+/* Glyph registry. Glyph gets CGRAM slot only while it is displayed, slots are
+reused in LRU order. Slots written by IOCTL_LCD_SET_CHAR or ESC g belong to
+the user and are never taken for glyphs. */
+#define HDPCF_SLOT_FREE    (-1)
+#define HDPCF_SLOT_USER    (-2)
+
+struct hdpcf_glyph {
+   unsigned char chr[8];
+   unsigned char fallback;
+   bool defined;
 };
 
-static struct i2c_client *client;
+struct hdpcf_slot {
+   /* glyph id, HDPCF_SLOT_FREE or HDPCF_SLOT_USER */
+   int glyph;
+   u64 used;
+};
+
+/* Scrolling text. DDRAM line is 40 columns long and only 16 are visible, the
+rest is loaded in advance and the view is moved by display shift command.
+DDRAM column c holds text column pos + (c - view) mod 40. Text up to 40
+columns costs single command per step, longer one also needs the column 39
+steps ahead of the view, which is off-screen, to be refilled. Steps are timed
+by hrtimer, bus I/O is done by work item. */
+#define HDPCF_DDRAM_LINE   40
+
+struct hdpcf_scroll {
+   unsigned char text[2][LCD_SCROLL_MAX];
+   int len;
+   bool right;
+   ktime_t period;
+   /* running, view and pos are valid */
+   bool active;
+   int view;
+   int pos;
+   struct hrtimer timer;
+   struct work_struct work;
+};
+
+/* Waits after commands in us. Defaults are the worst cases used before
+calibration. */
+struct hdpcf_timing {
+   unsigned int clear_us;
+   unsigned int home_us;
+   unsigned int cmd_us;
+   bool calibrated;
+};
+
+#define HDPCF_CLEAR_US     5000
+#define HDPCF_HOME_US      2000
+#define HDPCF_CMD_US       700
+/* Longest wait accepted from sysfs */
+#define HDPCF_TIMING_MAX   100000
+
+/* Submission queue. Producers (ioctl, write, mmap scan) only copy their
+request to a fixed-size record in the ring and kick the flush work, which is
+the only consumer. It merges all queued records into pending state and puts
+the result on the bus, so nibbles of concurrent writers can't interleave and
+producers never wait for the bus. Size has to be power of two. */
+#define HDPCF_RING_SIZE    64
+#define HDPCF_TEXT_MAX     32
+
+enum hdpcf_op {
+   HDPCF_OP_STATE,
+   HDPCF_OP_DISPLAY,
+   HDPCF_OP_CLEAR,
+   HDPCF_OP_HOME,
+   HDPCF_OP_SHIFT,
+   HDPCF_OP_CHAR,
+   HDPCF_OP_TEXT,
+   HDPCF_OP_MMAP,
+   HDPCF_OP_GLYPH,
+   HDPCF_OP_CELLS,
+   HDPCF_OP_SCROLL,
+   HDPCF_OP_FRAME,
+};
+
+struct hdpcf_parser;
+
+struct hdpcf_cmd {
+   enum hdpcf_op op;
+   /* LCD_PRIO_* class of the writer and time it was queued */
+   unsigned char prio;
+   ktime_t queued;
+   /* parser state of the writer, HDPCF_OP_TEXT only, the record holds a
+   reference */
+   struct hdpcf_parser* parser;
+   union {
+      struct lcd_hdpcf lcd;
+      struct user_char chr;
+      struct lcd_glyph glyph;
+      struct lcd_hdpcf_cells cells;
+      struct lcd_scroll scroll;
+      struct lcd_hdpcf_frame frame;
+      unsigned char dir;
+      struct {
+         unsigned char len;
+         unsigned char buf[HDPCF_TEXT_MAX];
+      } text;
+   };
+};
 
 struct hd44780_data {
    struct i2c_client* client;
-   unsigned char disp_data[2][16];
+   /* Open files and mappings keep the structure alive after remove, dead
+   tells them that the LCD is gone. */
+   struct kref ref;
+   bool dead;
+   int minor;
+   const struct hdpcf_geometry* geom;
+   struct cdev* cdev;
+   struct hdpcf_stats __percpu* stats;
+   struct dentry* debugfs;
+   struct hd44780_frame frame;
+   /* LCD is initialized by init_work, requests queued before that wait in
+   the ring until ready is set. When it fails, the device is dead and
+   init_err holds the reason. Both are set under lock and ring_lock. */
+   bool ready;
+   int init_err;
+   unsigned int init_step;
+   struct delayed_work init_work;
+   struct hdpcf_timing timing;
+   /* Shadow copy of visible DDRAM. It is trusted only when disp_valid is
+   set, after I2C error we don't know what really reached the controller. */
+   unsigned char disp_data[LCD_MAX_ROWS][LCD_MAX_COLS];
+   bool disp_valid;
+   /* Submission queue, see hdpcf_enqueue(). Protected by ring_lock. */
+   spinlock_t ring_lock;
+   struct hdpcf_cmd ring[HDPCF_RING_SIZE];
+   u64 ring_head;
+   u64 ring_tail;
+   u64 done_seq;
+   int done_err;
+   /* Frame of the latest IOCTL_LCD_COMMIT not taken by the consumer yet.
+   It's applied when the consumer gets to commit_pos in the queue, newer
+   commit replaces it. commit_done is commit_seq of the last frame put on
+   the bus. Protected by ring_lock. */
+   struct lcd_hdpcf_frame commit_frame;
+   bool commit_pending;
+   unsigned char commit_prio;
+   ktime_t commit_queued;
+   u64 commit_pos;
+   u64 commit_seq;
+   u64 commit_done;
+   /* High priority records in the queue, normal flush gives way to them.
+   Requests up to urgent_done are on the LCD as far as high priority ones
+   are concerned, urgent_err is the result. Protected by ring_lock. */
+   unsigned int urgent_queued;
+   u64 urgent_done;
+   int urgent_err;
+   /* Commit merged with high priority. Protected by ring_lock. */
+   u64 flush_commit_urgent;
+   /* Last high priority record the urgent pass completes. Records which
+   shift, move the cursor or scroll are done only by the whole flush, as
+   all high priority records after them; urgent_blocked is set then. Only
+   the flush work changes them, protected by lock. */
+   u64 urgent_seq;
+   bool urgent_blocked;
+   wait_queue_head_t wait;
+   /* Requests taken from the queue but not yet put on the bus, merged in
+   pending and described by HDPCF_PENDING_* bits in pending_flags. Only the
+   flush work changes them. Protected by lock, as all bus I/O. */
+   struct mutex lock;
+   struct lcd_hdpcf pending;
+   unsigned char pending_buf[LCD_MAX_ROWS][LCD_MAX_COLS];
+   /* Columns dirty_lo up to dirty_hi of each row changed since the last
+   update, only they are compared with the shadow */
+   unsigned char dirty_lo[LCD_MAX_ROWS];
+   unsigned char dirty_hi[LCD_MAX_ROWS];
+   /* Part of the dirty columns changed by high priority requests, written
+   first. apply_urgent is set while such request is merged. */
+   unsigned char urgent_lo[LCD_MAX_ROWS];
+   unsigned char urgent_hi[LCD_MAX_ROWS];
+   bool apply_urgent;
+   /* Preemptions the current flush may still take, see preempt_max. Only
+   the flush work changes it, protected by lock. */
+   unsigned int preempt_left;
+   /* Queue time of the oldest request of each class merged and not on the
+   LCD yet, 0 if none, and the worst latency seen */
+   ktime_t lane_queued[LCD_PRIOS];
+   unsigned long lane_max_us[LCD_PRIOS];
+   unsigned long pending_flags;
+   int pending_shift;
+   unsigned char pending_cgram[8][8];
+   unsigned char cgram_dirty;
+   /* Glyph id + 1 shown in the cell, 0 for plain character */
+   unsigned short pending_glyph[LCD_MAX_ROWS][LCD_MAX_COLS];
+   struct hdpcf_glyph* glyphs;
+   unsigned int nglyphs;
+   struct hdpcf_slot slots[8];
+   u64 glyph_tick;
+   /* Shadow copy of CGRAM, trusted for slots with bit set in cgram_known */
+   unsigned char cgram[8][8];
+   unsigned char cgram_known;
+   /* Requested by IOCTL_LCD_SCROLL and not stopped by content update yet */
+   bool scroll_req;
+   struct hdpcf_scroll scroll;
+   unsigned char cursor_x;
+   unsigned char cursor_y;
+   int flush_err;
+   struct work_struct flush_work;
+   /* Page with struct lcd_hdpcf mapped by userland and its copy from the
+   last scan, so unchanged page costs no bus I/O. */
+   struct page* mmap_page;
+   struct lcd_hdpcf mmap_seen;
+   atomic_t mmap_count;
+   struct delayed_work mmap_work;
    unsigned char backlight;
    unsigned char pcf_state;
    unsigned char cursor_state;
@@ -80,6 +465,9 @@ static struct i2c_driver hd44780_i2c_driver = {
    .class = I2C_CLASS_HWMON,
    .driver = {
       .name = "hdpcf",
+      .of_match_table = of_match_ptr(lcd_of_match),
+      /* init sleeps for a while, don't make the boot wait for it */
+      .probe_type = PROBE_PREFER_ASYNCHRONOUS,
    },
    .probe = hd44780_i2c_probe,
    .remove = hd44780_i2c_remove,
@@ -87,180 +475,487 @@ static struct i2c_driver hd44780_i2c_driver = {
    .id_table = lcd_id,
 };
 
-/* Function return negative if error */
+/* Puts whole frame on the bus and empties it. Messages are as long as the
+adapter allows. Adapters without plain I2C support get SMBus block writes or,
+as a last resort, one byte per transaction. Function return negative if
+error */
+static int hd44780_frame_flush(struct i2c_client* _client) {
+   struct hd44780_data* data = i2c_get_clientdata(_client);
+   struct hd44780_frame* frame = &data->frame;
+   struct i2c_adapter* adapter = _client->adapter;
+   ktime_t start = ktime_get();
+   int chunk = frame->len;
+   int pos = 0;
+   int transactions = 0;
+   int len;
+   int ret = 0;
+
+   if (!frame->len) return 0;
+   if (i2c_check_functionality(adapter, I2C_FUNC_I2C)) {
+      if (adapter->quirks && adapter->quirks->max_write_len)
+         chunk = min_t(int, chunk, adapter->quirks->max_write_len);
+   } else if (i2c_check_functionality(adapter,
+         I2C_FUNC_SMBUS_WRITE_I2C_BLOCK)) {
+      chunk = min_t(int, chunk, LCD_SMBUS_CHUNK);
+   } else {
+      chunk = 1;
+   }
+
+   while (pos < frame->len) {
+      len = min_t(int, chunk, frame->len - pos);
+      if (len == 1) {
+         ret = i2c_smbus_write_byte(_client, frame->buf[pos]);
+      } else if (i2c_check_functionality(adapter, I2C_FUNC_I2C)) {
+         ret = i2c_master_send(_client, (const char*)&frame->buf[pos], len);
+         if (ret >= 0 && ret != len) ret = -EIO;
+      } else {
+         ret = i2c_smbus_write_i2c_block_data(_client, frame->buf[pos],
+            len - 1, &frame->buf[pos + 1]);
+      }
+      transactions++;
+      if (ret < 0) {
+         trace_hdpcf_i2c_error(_client, ret);
+         this_cpu_inc(data->stats->i2c_errors);
+         break;
+      }
+      pos += len;
+   }
+   this_cpu_add(data->stats->bytes, pos);
+   this_cpu_add(data->stats->transactions, transactions);
+   trace_hdpcf_frame_flush(_client, pos, transactions, frame->cells,
+      ktime_to_ns(ktime_sub(ktime_get(), start)));
+   frame->len = 0;
+   frame->cells = 0;
+   return (ret < 0) ? ret : 0;
+}
+
+/* Appends single PCF8574 output state to the frame. */
+static int hd44780_frame_put_raw(struct i2c_client* _client,
+      unsigned char _state) {
+   struct hd44780_data* data = i2c_get_clientdata(_client);
+   int ret = 0;
+   if (data->frame.len == LCD_FRAME_SIZE) {
+      ret = hd44780_frame_flush(_client);
+      if (ret < 0) return ret;
+   }
+   data->frame.buf[data->frame.len++] = _state;
+   return 0;
+}
+
+/* Appends one command or data byte (four output states) to the frame.
+Function return negative if error */
+static int hd44780_frame_put(struct i2c_client* _client, char _mode,
+      char _data) {
+   struct hd44780_data* data = i2c_get_clientdata(_client);
+   unsigned char ctl = data->backlight | ((_mode == LCD_MODE_CMD) ? 0
+      : LCD_RS);
+   unsigned char hi = 0xf0 & _data;
+   unsigned char lo = (0x0f & _data) << 4;
+   int ret = 0;
+   if (data->frame.len > LCD_FRAME_SIZE - 4) {
+      ret = hd44780_frame_flush(_client);
+      if (ret < 0) return ret;
+   }
+   data->frame.buf[data->frame.len++] = hi | ctl | LCD_CS;
+   data->frame.buf[data->frame.len++] = hi | ctl;
+   data->frame.buf[data->frame.len++] = lo | ctl | LCD_CS;
+   data->frame.buf[data->frame.len++] = lo | ctl;
+   return 0;
+}
+
+/* Sends single command or data byte. Function return negative if error */
 static int hd44780_i2c_send(struct i2c_client* _client, char _mode,
       char _data) {
    int ret = 0;
+   ret = hd44780_frame_put(_client, _mode, _data);
+   if (ret < 0) return ret;
+   return hd44780_frame_flush(_client);
+}
+
+/* Fixed delay used when the busy flag is not polled. It's the worst case
+taken from the datasheet. All callers run in process context, so it sleeps
+instead of spinning. */
+static void hd44780_delay(unsigned int _us) {
+   if (_us >= 1000)
+      msleep(DIV_ROUND_UP(_us, 1000));
+   else
+      usleep_range(_us, _us + _us / 4);
+}
+
+/* Reads busy flag. D4-D7 are set high, so PCF8574 quasi-bidirectional
+outputs can be pulled down by the controller. The second E pulse clocks out
+the low nibble (address counter), 4-bit interface always transfers both.
+Returns 1 when busy, 0 when ready, negative if error. */
+static int hd44780_read_busy(struct i2c_client* _client) {
    struct hd44780_data* data = i2c_get_clientdata(_client);
-   unsigned char bl = data->backlight;
-   switch (_mode) {
-      case 0:
-         ret |= i2c_smbus_write_byte(_client, (0xf0 & _data) | bl | (LCD_CS
-            & ~LCD_RS));
-         ret |= i2c_smbus_write_byte(_client, (0xf0 & _data) | (bl & ~LCD_CS
-            & ~LCD_RS));
-         ret |= i2c_smbus_write_byte(_client, ((0x0f & _data) << 4) | bl
-            | (LCD_CS & ~LCD_RS));
-         ret |= i2c_smbus_write_byte(_client, ((0x0f & _data) << 4) | (bl
-            & ~LCD_CS & ~LCD_RS));
-      break;
-      default:
-         ret |= i2c_smbus_write_byte(_client, (0xf0 & _data) | (bl
-            | LCD_CS | LCD_RS));
-         ret |= i2c_smbus_write_byte(_client, (0xf0 & _data) | (bl
-            & (~LCD_CS)) | (LCD_RS));
-         ret |= i2c_smbus_write_byte(_client, ((0x0f & _data) << 4)
-            | (bl | LCD_CS | LCD_RS));
-         ret |= i2c_smbus_write_byte(_client, ((0x0f & _data) << 4)
-            | ((bl) & (~LCD_CS)) | (LCD_RS));
-      break;
+   unsigned char rd = 0xf0 | data->backlight | LCD_RW;
+   int val;
+   int ret = 0;
+   ret = hd44780_frame_put_raw(_client, rd | LCD_CS);
+   if (ret < 0) return ret;
+   ret = hd44780_frame_flush(_client);
+   if (ret < 0) return ret;
+   val = i2c_smbus_read_byte(_client);
+   if (val < 0) {
+      trace_hdpcf_i2c_error(_client, val);
+      this_cpu_inc(data->stats->i2c_errors);
+   }
+   ret = hd44780_frame_put_raw(_client, rd);
+   if (ret < 0) return ret;
+   ret = hd44780_frame_put_raw(_client, rd | LCD_CS);
+   if (ret < 0) return ret;
+   ret = hd44780_frame_put_raw(_client, rd);
+   if (ret < 0) return ret;
+   ret = hd44780_frame_flush(_client);
+   if (val < 0) return val;
+   if (ret < 0) return ret;
+   return (val & LCD_D7) ? 1 : 0;
+}
+
+/* Waits until the last command is executed. With busy_poll set BF is read
+back until it clears or busy_timeout_us elapses, otherwise (and when reading
+fails or times out) fixed delay _us is used. When reading fails the error is
+returned after the delay, so the caller can tell the bus is broken. */
+static int hd44780_wait_ready(struct i2c_client* _client, unsigned int _us) {
+   struct hd44780_data* data = i2c_get_clientdata(_client);
+   ktime_t start;
+   int polls = 0;
+   int ret = 0;
+   if (!busy_poll || !i2c_check_functionality(_client->adapter,
+         I2C_FUNC_SMBUS_READ_BYTE)) {
+      trace_hdpcf_delay(_client, _us);
+      hd44780_delay(_us);
+      return 0;
+   }
+   start = ktime_get();
+   do {
+      ret = hd44780_read_busy(_client);
+      polls++;
+      if (ret <= 0) break;
+   } while (ktime_us_delta(ktime_get(), start) < busy_timeout_us);
+   trace_hdpcf_busy_wait(_client, polls, ret == 0,
+      ktime_to_ns(ktime_sub(ktime_get(), start)));
+   this_cpu_add(data->stats->busy_retries, polls - 1);
+   if (ret == 0) return 0;
+   if (ret > 0) this_cpu_inc(data->stats->busy_timeouts);
+   trace_hdpcf_delay(_client, _us);
+   hd44780_delay(_us);
+   return (ret < 0) ? ret : 0;
+}
+
+
+/* Set-address command costs as much as one data byte, so unchanged gaps up to
+this length are cheaper to rewrite than to jump over. */
+#define LCD_DIFF_GAP       1
+
+/* Marks whole shadow as blank, which is the DDRAM content after clear. */
+static void lcd_shadow_blank(struct hd44780_data* _data) {
+   memset(_data->disp_data, ' ', sizeof(_data->disp_data));
+   _data->disp_valid = true;
+}
+
+/* Extends dirty range of row _y over columns _x0 up to _x1 (excluded) */
+static void hdpcf_dirty(struct hd44780_data* _data, int _y, int _x0,
+      int _x1) {
+   _data->dirty_lo[_y] = min_t(int, _data->dirty_lo[_y], _x0);
+   _data->dirty_hi[_y] = max_t(int, _data->dirty_hi[_y], _x1);
+   if (_data->apply_urgent) {
+      _data->urgent_lo[_y] = min_t(int, _data->urgent_lo[_y], _x0);
+      _data->urgent_hi[_y] = max_t(int, _data->urgent_hi[_y], _x1);
    }
+}
+
+static void hdpcf_urgent_reset(struct hd44780_data* _data) {
+   memset(_data->urgent_lo, LCD_MAX_COLS, sizeof(_data->urgent_lo));
+   memset(_data->urgent_hi, 0, sizeof(_data->urgent_hi));
+}
+
+static void hdpcf_dirty_reset(struct hd44780_data* _data) {
+   memset(_data->dirty_lo, LCD_MAX_COLS, sizeof(_data->dirty_lo));
+   memset(_data->dirty_hi, 0, sizeof(_data->dirty_hi));
+   hdpcf_urgent_reset(_data);
+}
+
+static bool hdpcf_urgent_waiting(struct hd44780_data* _data) {
+   bool ret;
+   spin_lock(&_data->ring_lock);
+   ret = _data->urgent_queued > 0 || (_data->commit_pending
+      && _data->commit_prio == LCD_PRIO_HIGH);
+   spin_unlock(&_data->ring_lock);
    return ret;
 }
 
+/* Content is compared with the shadow of DDRAM and only changed runs are
+sent, each preceded by single set-address command. Only dirty columns are
+looked at, so the cost depends on the change, not on the size of the panel.
+Rewriting without CLEAR command avoids visible blinking. Runs are put to the
+frame, caller flushes it. With _urgent set only columns changed by high
+priority requests are written. Otherwise, when the shadow is valid, the
+frame goes to the bus every preempt_cells characters and if high priority
+request is waiting and the flush may still be preempted, HDPCF_PREEMPTED is
+returned; columns not written yet stay dirty. If I2C error, -EIO returned and the shadow is invalidated, so
+next update rewrites all cells. */
+#define HDPCF_PREEMPTED    1
 
-/* We assume that userland want to write max two lines. Max size is 34 (two
-full lines and two \n). If userland wants to write more, -ENOSPACE is
-returned. After writing cursor is set to home position. Lines shorter than
-16 characters are filled with spaces to write full display. It's nessesary
-for clearing old content without CLEAR command. CLEAR command causes visible
-blinking. */
-static ssize_t lcd_update_display(struct lcd_hdpcf* _lcd) {
-   struct i2c_client* _client = client;
-   int i;
+static ssize_t lcd_update_display(struct hd44780_data* _data,
+      unsigned char (*_buf)[LCD_MAX_COLS], bool _urgent) {
+   struct i2c_client* _client = _data->client;
+   const struct hdpcf_geometry* geom = _data->geom;
+   unsigned char* lo = (_urgent) ? _data->urgent_lo : _data->dirty_lo;
+   unsigned char* hi = (_urgent) ? _data->urgent_hi : _data->dirty_hi;
+   unsigned int chunk = (_urgent || !_data->disp_valid
+      || !_data->preempt_left) ? 0 : preempt_cells;
+   unsigned int cells = 0;
+   int x, y, start, end, last;
    int ret = 0;
-   for (i = 0; i < 16; i++){
-      ret = hd44780_i2c_send(_client, LCD_MODE_DATA, _lcd->buffer[0][i]);
-   }
-   hd44780_i2c_send(_client, LCD_MODE_CMD, 0xC0);
-   for (i = 0; i < 16; i++) {
-      ret = hd44780_i2c_send(_client, LCD_MODE_DATA, _lcd->buffer[1][i]);
+   for (y = 0; y < geom->rows; y++) {
+      x = (_data->disp_valid) ? lo[y] : 0;
+      last = (_data->disp_valid) ? hi[y] : geom->cols;
+      while (x < last) {
+         if (_data->disp_valid && _data->disp_data[y][x] == _buf[y][x]) {
+            this_cpu_inc(_data->stats->cells_skipped);
+            x++;
+            continue;
+         }
+         /* extend the run over changed cells and short unchanged gaps */
+         start = x;
+         end = x;
+         for (x = x + 1; x < last && x <= end + LCD_DIFF_GAP + 1; x++) {
+            if (!_data->disp_valid || _data->disp_data[y][x] != _buf[y][x])
+               end = x;
+         }
+         x = end + 1;
+         ret = hd44780_frame_put(_client, LCD_MODE_CMD, 0x80
+            + geom->row_offset[y] + start);
+         if (ret < 0) goto update_error;
+         for (; start <= end; start++) {
+            ret = hd44780_frame_put(_client, LCD_MODE_DATA, _buf[y][start]);
+            if (ret < 0) goto update_error;
+            _data->frame.cells++;
+            this_cpu_inc(_data->stats->cells_written);
+            _data->disp_data[y][start] = _buf[y][start];
+            if (!chunk || ++cells % chunk) continue;
+            ret = hd44780_frame_flush(_client);
+            if (ret < 0) goto update_error;
+            if (!hdpcf_urgent_waiting(_data)) continue;
+            /* rows above are done, this one goes on after start */
+            memset(lo, LCD_MAX_COLS, y);
+            memset(hi, 0, y);
+            lo[y] = start + 1;
+            return HDPCF_PREEMPTED;
+         }
+      }
    }
+   if (_urgent)
+      hdpcf_urgent_reset(_data);
+   else
+      hdpcf_dirty_reset(_data);
+   _data->disp_valid = true;
    return 0;
+
+update_error:
+   hdpcf_dirty_reset(_data);
+   _data->disp_valid = false;
+   return -EIO;
 }
 
 /* Set cursor state to dash on or off. Blink overrides curror setting.
-If I2C error, -EIO returned. */
-static ssize_t lcd_update_state(struct lcd_hdpcf* _lcd) {
-   struct i2c_client* _client = client;
-   struct hd44780_data* _data = i2c_get_clientdata(_client);
+Command is put to the frame. If I2C error, -EIO returned. */
+static ssize_t lcd_update_state(struct hd44780_data* _data,
+      struct lcd_hdpcf* _lcd) {
+   struct i2c_client* _client = _data->client;
    int ret;
    _data->cursor_state = (_lcd->cursor_state) ? LCD_CURSOR : 0;
    _data->cursor_blink = (_lcd->cursor_blink) ? LCD_CURSOR_BLINK : 0;
    _data->display_state = (_lcd->display_state) ? LCD_DISPLAY : 0;
    _data->backlight = (_lcd->backlight_state) ? LCD_BL : 0;
-   ret = hd44780_i2c_send(_client, LCD_MODE_CMD, 0x08 | _data->cursor_state
+   ret = hd44780_frame_put(_client, LCD_MODE_CMD, 0x08 | _data->cursor_state
       | _data->cursor_blink | _data->display_state);
    if (ret < 0) return -EIO;
-   ret = i2c_smbus_write_byte(_client, 0xf0 | LCD_CS | _data->backlight);
+   ret = hd44780_frame_put_raw(_client, 0xf0 | LCD_CS | _data->backlight);
    if (ret < 0) return -EIO;
    return 0;
 }
 
-/* Sets curor position. If I2C error -EIO returned. */
-static int lcd_gotoxy(unsigned char _x, unsigned char _y) {
-   struct i2c_client* _client = client;
+/* Sets curor position. Command is put to the frame. If I2C error -EIO
+returned. */
+static int lcd_gotoxy(struct hd44780_data* _data, unsigned char _x,
+      unsigned char _y) {
+   struct i2c_client* _client = _data->client;
    int ret = 0;
-   if (_x > 15 ) _x = 15;
-   if (_y > 1 ) _y = 1;
-   ret = hd44780_i2c_send(_client, LCD_MODE_CMD, 0x80 + ((64 * _y) + _x));
+   if (_x > _data->geom->cols - 1) _x = _data->geom->cols - 1;
+   if (_y > _data->geom->rows - 1) _y = _data->geom->rows - 1;
+   ret = hd44780_frame_put(_client, LCD_MODE_CMD, 0x80
+      + _data->geom->row_offset[_y] + _x);
    if (ret < 0) return -EIO;
    return 0;
 }
 
-/* Shifts lcd content to left (0) or right (1). If I2C error -EIO returned. */
-static ssize_t lcd_shift(unsigned char _dir) {
-   struct i2c_client* _client = client;
+/* Shifts lcd content to left (0) or right (1). Command is put to the frame.
+If I2C error -EIO returned. */
+static ssize_t lcd_shift(struct hd44780_data* _data, unsigned char _dir) {
+   struct i2c_client* _client = _data->client;
    int ret = 0;
-   ret = hd44780_i2c_send(_client, LCD_MODE_CMD, 0x18 | ((_dir == 0) ? 0 : 4));
+   ret = hd44780_frame_put(_client, LCD_MODE_CMD, 0x18 | ((_dir == 0) ? 0 : 4));
    if (ret < 0) return -EIO;
    return 0;
 }
 
 
 /* Clears display. If I2C error, -EIO returned. */
-static ssize_t lcd_clear(void) {
-  struct i2c_client* _client = client;
+static ssize_t lcd_clear(struct hd44780_data* _data) {
+  struct i2c_client* _client = _data->client;
   int ret = 0;
   ret = hd44780_i2c_send(_client, LCD_MODE_CMD, 0x1);
-  if (ret < 0) return -EIO;
+  if (ret < 0) {
+     _data->disp_valid = false;
+     return -EIO;
+  }
+  lcd_shadow_blank(_data);
   return 0;
 }
 
-/* Sets user defined char to CGRAM. If bad CGRAM address -ENXIO is returned,
-if I2C error, -EIO returned */
-static ssize_t lcd_set_char(struct user_char* _char) {
-  struct i2c_client* _client = client;
+/* Sets user defined char to CGRAM. Commands are put to the frame. If bad
+CGRAM address -ENXIO is returned, if I2C error, -EIO returned */
+static ssize_t lcd_set_char(struct hd44780_data* _data,
+      struct user_char* _char) {
+  struct i2c_client* _client = _data->client;
   int ret = 0;
   int i = 0;
   if (_char->address < 0 || _char->address > 7) return -ENXIO;
-  ret = hd44780_i2c_send(_client, LCD_MODE_CMD, 0x40 + _char->address);
+  ret = hd44780_frame_put(_client, LCD_MODE_CMD, 0x40 + _char->address * 8);
+  if (ret < 0) return -EIO;
   for (i = 0; i < 8; i++) {
-     ret = hd44780_i2c_send(_client, LCD_MODE_DATA, _char->chr[i]);
+     ret = hd44780_frame_put(_client, LCD_MODE_DATA, _char->chr[i]);
      if (ret < 0) return -EIO;
   }
   return 0;
 }
 
 
-/* Typical initialization procedure of hd44780 with 4-bit interface */
-static int hd44780_i2c_init(struct i2c_client* _client) {
-   int ret = 0;
-   ret = i2c_smbus_write_byte(_client, 0x30 | LCD_CS);
-   if (ret < 0) goto init_error;
-   ret = i2c_smbus_write_byte(_client, 0x30 & ~LCD_CS);
-   if (ret < 0) goto init_error;
-   msleep(5);
-   ret = i2c_smbus_write_byte(_client, 0x30 | LCD_CS);
-   if (ret < 0) goto init_error;
-   ret = i2c_smbus_write_byte(_client, 0x30 & ~LCD_CS);
-   if (ret < 0) goto init_error;
-   udelay(200);
-   ret = i2c_smbus_write_byte(_client, 0x30 | LCD_CS);
-   if (ret < 0) goto init_error;
-   ret = i2c_smbus_write_byte(_client, 0x30 & ~LCD_CS);
-   if (ret < 0) goto init_error;
-   udelay(200);
-   ret = i2c_smbus_write_byte(_client, 0x20 | LCD_CS);
-   if (ret < 0) goto init_error;
-   ret = i2c_smbus_write_byte(_client, 0x20 & ~LCD_CS);
-   if (ret < 0) goto init_error;
-   udelay(700);
-   ret = hd44780_i2c_send(_client, LCD_MODE_CMD, 0x28);
-   if (ret < 0) goto init_error;
-   udelay(700);
-   ret = hd44780_i2c_send(_client, LCD_MODE_CMD, 0x08);
-   if (ret < 0) goto init_error;
-   udelay(700);
-   ret = hd44780_i2c_send(_client, LCD_MODE_CMD, 0x01);
-   if (ret < 0) goto init_error;
-   udelay(700);
-   ret = hd44780_i2c_send(_client, LCD_MODE_CMD, 0x06);
-   if (ret < 0) goto init_error;
-   udelay(700);
-   ret = hd44780_i2c_send(_client, LCD_MODE_CMD, 0x0E);
-   if (ret < 0) goto init_error;
-   return 0;
+/* Single E pulse with given nibble, used while controller is still in 8-bit
+mode. Both output states go in one transaction. */
+static int hd44780_init_nibble(struct i2c_client* _client,
+      unsigned char _nibble) {
+   int ret = 0;
+   ret = hd44780_frame_put_raw(_client, _nibble | LCD_CS);
+   if (ret < 0) return ret;
+   ret = hd44780_frame_put_raw(_client, _nibble & ~LCD_CS);
+   if (ret < 0) return ret;
+   return hd44780_frame_flush(_client);
+}
 
-init_error:
-   dev_err(&_client->dev, "lcd_drv: Error in lcd initialization, errno: %d\n",
-      ret);
-   return ret;
+/* Typical initialization procedure of hd44780 with 4-bit interface. First
+nibbles go while the controller may still be in 8-bit mode, the rest are
+commands. Nibble is followed by its delay in us, command by the wait from the
+timing profile. */
+struct hd44780_init_step {
+   bool nibble;
+   unsigned char val;
+   unsigned int us;
+};
+
+static const struct hd44780_init_step hd44780_init_seq[] = {
+   { true, 0x30, 5000 },
+   { true, 0x30, 200 },
+   { true, 0x30, 200 },
+   { true, 0x20, 0 },
+   { false, 0x28, 0 },
+   { false, 0x08, 0 },
+   { false, 0x01, 0 },
+   { false, 0x06, 0 },
+   { false, 0x0E, 0 },
+};
+
+/* Wait after the command, taken from the timing profile */
+static unsigned int hdpcf_cmd_us(struct hd44780_data* _data,
+      unsigned char _cmd) {
+   if (_cmd == 0x01) return _data->timing.clear_us;
+   if ((_cmd & 0xfe) == 0x02) return _data->timing.home_us;
+   return _data->timing.cmd_us;
+}
+
+/* Sends command and measures how long the controller stays busy, including
+the last poll. Returns time in us, negative if error or -ETIMEDOUT if the
+busy flag didn't clear in busy_timeout_us. Has to be called with lock held. */
+static int hdpcf_measure_locked(struct hd44780_data* _data,
+      unsigned char _cmd) {
+   ktime_t start;
+   int ret = 0;
+   ret = hd44780_i2c_send(_data->client, LCD_MODE_CMD, _cmd);
+   if (ret < 0) return ret;
+   start = ktime_get();
+   do {
+      ret = hd44780_read_busy(_data->client);
+      if (ret <= 0) break;
+   } while (ktime_us_delta(ktime_get(), start) < busy_timeout_us);
+   if (ret < 0) return ret;
+   if (ret > 0) return -ETIMEDOUT;
+   return ktime_us_delta(ktime_get(), start);
+}
+
+#define HDPCF_CALIBRATE_RUNS  3
+
+/* Calibration pass. Clear, home and entry mode set are measured a few times
+and the longest time plus a quarter is stored in the profile. Busy flag
+resolution is one I2C read, so the result is never shorter than the real
+execution time. Clear shorter than 100 us can't be right (datasheet says
+1.52 ms), then the busy flag is not wired and the defaults are kept. Leaves
+the LCD cleared. Has to be called with lock held. */
+static void hdpcf_calibrate_locked(struct hd44780_data* _data) {
+   static const unsigned char cmds[] = { 0x01, 0x02, 0x06 };
+   unsigned int worst[ARRAY_SIZE(cmds)] = { 0 };
+   int i, run;
+   int ret = 0;
+   if (!i2c_check_functionality(_data->client->adapter,
+         I2C_FUNC_SMBUS_READ_BYTE)) {
+      dev_info(&_data->client->dev, "lcd_drv: Busy flag can't be read, "
+         "calibration skipped\n");
+      return;
+   }
+   for (run = 0; run < HDPCF_CALIBRATE_RUNS; run++) {
+      for (i = 0; i < ARRAY_SIZE(cmds); i++) {
+         ret = hdpcf_measure_locked(_data, cmds[i]);
+         if (ret < 0) goto calibrate_error;
+         worst[i] = max_t(unsigned int, worst[i], ret);
+      }
+   }
+   if (worst[0] < 100) {
+      ret = -EIO;
+      goto calibrate_error;
+   }
+   _data->timing.clear_us = worst[0] + worst[0] / 4;
+   _data->timing.home_us = worst[1] + worst[1] / 4;
+   _data->timing.cmd_us = worst[2] + worst[2] / 4;
+   _data->timing.calibrated = true;
+   dev_info(&_data->client->dev, "lcd_drv: Calibrated clear %u us, home %u "
+      "us, command %u us\n", _data->timing.clear_us, _data->timing.home_us,
+      _data->timing.cmd_us);
+   return;
+
+calibrate_error:
+   dev_info(&_data->client->dev, "lcd_drv: Calibration failed, errno: %d, "
+      "default timing used\n", ret);
+   /* LCD may be in the middle of the last command */
+   hd44780_delay(_data->timing.clear_us);
 }
 
 /* Deinitialization is not needed, but when lcd is no longer avialiable in the
 system, i think there is no need to keep last displayed data. Clear display,
 off cursor and off display. */
 static int hd44780_i2c_deinit(struct i2c_client* _client) {
+   struct hd44780_data* data = i2c_get_clientdata(_client);
    int ret = 0;
    //clear display
    ret = hd44780_i2c_send(_client, LCD_MODE_CMD, 0x01);
    if (ret < 0) goto deinit_error;
    //off display, off cursor
-   msleep(1);
+   ret = hd44780_wait_ready(_client, data->timing.clear_us);
+   if (ret < 0) goto deinit_error;
    ret = hd44780_i2c_send(_client, LCD_MODE_CMD, 0x08);
    if (ret < 0) goto deinit_error;
-   msleep(1);
+   ret = hd44780_wait_ready(_client, data->timing.cmd_us);
+   if (ret < 0) goto deinit_error;
    ret = i2c_smbus_write_byte(_client, (0xf0 | (LCD_CS & ~LCD_BL)));
    if (ret < 0) goto deinit_error;
    return 0;
@@ -271,151 +966,1979 @@ deinit_error:
 
 }
 
-/* Nothing special to probe() function. Allocate resources and prepare device
-to operate */
-static int hd44780_i2c_probe(struct i2c_client* _client,
-      const struct i2c_device_id* _id) {
-   struct device* dev = &_client->dev;
-   struct hd44780_data* data;
+/* Puts 8 rows to CGRAM slot, unless they are already there. Commands are put
+to the frame. Has to be called with lock held. */
+static int hdpcf_cgram_load(struct hd44780_data* _data, int _slot,
+      const unsigned char* _rows) {
+   struct user_char chr;
+   int ret = 0;
+   if ((_data->cgram_known & (1 << _slot))
+         && !memcmp(_data->cgram[_slot], _rows, sizeof(chr.chr))) {
+      this_cpu_inc(_data->stats->cgram_skipped);
+      return 0;
+   }
+   memcpy(chr.chr, _rows, sizeof(chr.chr));
+   chr.address = _slot;
+   ret = lcd_set_char(_data, &chr);
+   if (ret < 0) {
+      _data->cgram_known = 0;
+      return ret;
+   }
+   memcpy(_data->cgram[_slot], _rows, sizeof(chr.chr));
+   _data->cgram_known |= 1 << _slot;
+   this_cpu_inc(_data->stats->cgram_uploads);
+   return 0;
+}
+
+/* CGRAM slot holding glyph _id, -1 if it's not resident */
+static int hdpcf_glyph_slot(struct hd44780_data* _data, int _id) {
+   int slot;
+   for (slot = 0; slot < 8; slot++) {
+      if (_data->slots[slot].glyph == _id) return slot;
+   }
+   return -1;
+}
+
+/* Maps glyphs of pending cells to CGRAM slots and puts slot codes to _buf.
+Resident glyphs keep their slots, they are all marked needed by the first
+pass, which only reads pending_glyph. The second pass gives other glyphs free
+or least recently used slots not needed by this frame. It's limited to the
+dirty ranges, only they are written to the LCD (whole content is when the
+shadow is invalid), so a flush restarted after preemption doesn't walk
+the whole panel again. Glyph without slot or definition is shown as its
+fallback. Cell which got other code than the LCD shows is marked dirty. Has to
+be called with lock held. */
+static int hdpcf_glyphs_resolve_locked(struct hd44780_data* _data,
+      unsigned char (*_buf)[LCD_MAX_COLS]) {
+   struct hdpcf_glyph* g;
+   unsigned char needed = 0;
+   int x, y, x0, x1, i, id, slot;
    int ret = 0;
+   _data->glyph_tick++;
+   for (y = 0; y < _data->geom->rows; y++) {
+      for (x = 0; x < _data->geom->cols; x++) {
+         if (!_data->pending_glyph[y][x]) continue;
+         id = _data->pending_glyph[y][x] - 1;
+         if (!_data->glyphs[id].defined) continue;
+         slot = hdpcf_glyph_slot(_data, id);
+         if (slot < 0 || (needed & (1 << slot))) continue;
+         needed |= 1 << slot;
+         _data->slots[slot].used = _data->glyph_tick;
+         ret = hdpcf_cgram_load(_data, slot, _data->glyphs[id].chr);
+         if (ret < 0) return ret;
+      }
+   }
+   for (y = 0; y < _data->geom->rows; y++) {
+      x0 = (_data->disp_valid) ? _data->dirty_lo[y] : 0;
+      x1 = (_data->disp_valid) ? _data->dirty_hi[y] : _data->geom->cols;
+      for (x = x0; x < x1; x++) {
+         if (!_data->pending_glyph[y][x]) continue;
+         id = _data->pending_glyph[y][x] - 1;
+         g = &_data->glyphs[id];
+         if (!g->defined) {
+            _buf[y][x] = ' ';
+            goto resolve_dirty;
+         }
+         slot = hdpcf_glyph_slot(_data, id);
+         if (slot < 0) {
+            for (i = 0; i < 8; i++) {
+               if (_data->slots[i].glyph == HDPCF_SLOT_USER
+                     || (needed & (1 << i)))
+                  continue;
+               if (slot < 0 || _data->slots[i].used < _data->slots[slot].used)
+                  slot = i;
+            }
+         }
+         if (slot < 0) {
+            _buf[y][x] = g->fallback;
+            goto resolve_dirty;
+         }
+         if (!(needed & (1 << slot))) {
+            needed |= 1 << slot;
+            _data->slots[slot].glyph = id;
+            _data->slots[slot].used = _data->glyph_tick;
+            ret = hdpcf_cgram_load(_data, slot, g->chr);
+            if (ret < 0) return ret;
+         }
+         _buf[y][x] = slot;
+resolve_dirty:
+         if (_buf[y][x] != _data->disp_data[y][x]) hdpcf_dirty(_data, y, x,
+            x + 1);
+      }
+   }
+   return 0;
+}
 
-   data = devm_kzalloc(dev, sizeof(struct hd44780_data), GFP_KERNEL);
-   if (!data) {
-      printk(KERN_CRIT "lcd_drv: Out of memory\n");
-      return -ENOMEM;
+/* Text column _i of scrolled line _y, shorter text is padded to the DDRAM
+line length */
+static unsigned char hdpcf_scroll_char(struct hdpcf_scroll* _sc, int _y,
+      int _i) {
+   _i %= max(_sc->len, HDPCF_DDRAM_LINE);
+   return (_i < _sc->len) ? _sc->text[_y][_i] : ' ';
+}
+
+/* Puts text column _i to DDRAM column _col of both lines */
+static int hdpcf_scroll_fill(struct hd44780_data* _data, int _col, int _i) {
+   int y;
+   int ret = 0;
+   for (y = 0; y < 2; y++) {
+      ret = hd44780_frame_put(_data->client, LCD_MODE_CMD, 0x80
+         + _data->geom->row_offset[y] + _col);
+      if (ret < 0) return ret;
+      ret = hd44780_frame_put(_data->client, LCD_MODE_DATA,
+         hdpcf_scroll_char(&_data->scroll, y, _i));
+      if (ret < 0) return ret;
    }
-   data->client = _client;
-   data->backlight = LCD_BL;
-   data->cursor_state = 0;
-   data->cursor_blink = 0;
-   data->display_state = 1;
-   i2c_set_clientdata(_client, data);
-   ret = hd44780_i2c_init(_client);
-   if (ret < 0) goto probe_error;
-  return 0;
+   return 0;
+}
 
-probe_error:
-   dev_err(&_client->dev, "lcd_drv: Probe error, errno: %d\n", ret);
+/* One step of scrolling, commands are put to the frame. Column refilled for
+text longer than DDRAM line is written while it's off-screen: before the step
+to the right, after the step to the left. */
+static int hdpcf_scroll_step_locked(struct hd44780_data* _data) {
+   struct hdpcf_scroll* sc = &_data->scroll;
+   int n = max(sc->len, HDPCF_DDRAM_LINE);
+   int old = sc->view;
+   int ret = 0;
+   if (sc->right) {
+      sc->view = (sc->view + HDPCF_DDRAM_LINE - 1) % HDPCF_DDRAM_LINE;
+      sc->pos = (sc->pos + n - 1) % n;
+      if (sc->len > HDPCF_DDRAM_LINE) {
+         ret = hdpcf_scroll_fill(_data, sc->view, sc->pos);
+         if (ret < 0) return ret;
+      }
+      return lcd_shift(_data, 1);
+   }
+   sc->view = (sc->view + 1) % HDPCF_DDRAM_LINE;
+   sc->pos = (sc->pos + 1) % n;
+   ret = lcd_shift(_data, 0);
+   if (ret < 0) return ret;
+   if (sc->len > HDPCF_DDRAM_LINE)
+      ret = hdpcf_scroll_fill(_data, old, sc->pos + HDPCF_DDRAM_LINE - 1);
    return ret;
+}
 
+static enum hrtimer_restart hdpcf_scroll_timer(struct hrtimer* _timer) {
+   struct hd44780_data* data = container_of(_timer, struct hd44780_data,
+      scroll.timer);
+   /* step still waiting for the bus is not queued twice, text just moves
+   slower on slow bus */
+   queue_work(system_highpri_wq, &data->scroll.work);
+   hrtimer_forward_now(_timer, data->scroll.period);
+   return HRTIMER_RESTART;
 }
 
-/* Deinitiazation on remove */
-static int hd44780_i2c_remove(struct i2c_client* _client) {
+static void hdpcf_scroll_work(struct work_struct* _work) {
+   struct hd44780_data* data = container_of(_work, struct hd44780_data,
+      scroll.work);
+   int ret = 0;
+   mutex_lock(&data->lock);
+   if (!data->dead && data->scroll.active) {
+      ret = hdpcf_scroll_step_locked(data);
+      if (ret == 0) ret = hd44780_frame_flush(data->client);
+      if (ret < 0 && !data->flush_err) data->flush_err = ret;
+   }
+   mutex_unlock(&data->lock);
+}
+
+/* Returns display from shifted position, DDRAM is left as it is */
+static int lcd_return_home(struct hd44780_data* _data) {
    int ret = 0;
-   ret = hd44780_i2c_deinit(_client);
+   ret = hd44780_i2c_send(_data->client, LCD_MODE_CMD, 0x02);
+   if (ret < 0) return ret;
+   return hd44780_wait_ready(_data->client, _data->timing.home_us);
+}
+
+/* Stops the timer and returns the view home. DDRAM holds scrolled text, so
+shadow is invalidated and the content is rewritten. Has to be called with
+lock held. */
+static int hdpcf_scroll_stop_locked(struct hd44780_data* _data) {
+   hrtimer_cancel(&_data->scroll.timer);
+   _data->scroll.active = false;
+   _data->disp_valid = false;
+   return lcd_return_home(_data);
+}
+
+/* Loads whole DDRAM with the beginning of the text and starts the timer.
+Commands are put to the frame. Has to be called with lock held. */
+static int hdpcf_scroll_start_locked(struct hd44780_data* _data) {
+   struct hdpcf_scroll* sc = &_data->scroll;
+   int x, y;
+   int ret = 0;
+   ret = lcd_return_home(_data);
+   if (ret < 0) return ret;
+   _data->disp_valid = false;
+   for (y = 0; y < 2; y++) {
+      ret = hd44780_frame_put(_data->client, LCD_MODE_CMD, 0x80
+         + _data->geom->row_offset[y]);
+      if (ret < 0) return ret;
+      for (x = 0; x < HDPCF_DDRAM_LINE; x++) {
+         ret = hd44780_frame_put(_data->client, LCD_MODE_DATA,
+            hdpcf_scroll_char(sc, y, x));
+         if (ret < 0) return ret;
+      }
+   }
+   sc->view = 0;
+   sc->pos = 0;
+   sc->active = true;
+   hrtimer_start(&sc->timer, sc->period, HRTIMER_MODE_REL);
+   return 0;
+}
+
+/* Requests of class _prio merged so far are on the LCD, the oldest of them
+goes to the latency histogram of the class. Has to be called with lock
+held. */
+static void hdpcf_lane_done_locked(struct hd44780_data* _data, int _prio) {
+   s64 us;
+   if (!_data->lane_queued[_prio]) return;
+   us = ktime_us_delta(ktime_get(), _data->lane_queued[_prio]);
+   this_cpu_inc(_data->stats->hist[HDPCF_HIST_LANE_NORMAL + _prio][min_t(int,
+      fls64(us), HDPCF_HIST_BUCKETS - 1)]);
+   if (us > _data->lane_max_us[_prio]) _data->lane_max_us[_prio] = us;
+   _data->lane_queued[_prio] = 0;
+}
+
+/* Content of high priority requests goes to the bus before the rest, in a
+frame of its own, and their synchronous callers are released right after,
+up to urgent_seq.
+Cells written here match the shadow then, so the normal pass skips them.
+With invalid shadow everything is rewritten by the normal pass anyway. Has
+to be called with lock held. */
+static int hdpcf_urgent_flush_locked(struct hd44780_data* _data,
+      unsigned char (*_buf)[LCD_MAX_COLS]) {
+   int y, ret = 0;
+   for (y = 0; y < _data->geom->rows; y++) {
+      if (_data->urgent_lo[y] < _data->urgent_hi[y]) break;
+   }
+   if (y == _data->geom->rows || !_data->disp_valid) return 0;
+   ret = lcd_update_display(_data, _buf, true);
+   if (ret >= 0) ret = hd44780_frame_flush(_data->client);
    if (ret < 0) {
-      dev_err(&_client->dev, "lcd_drv: Error while removing device, \
-         errno %d\n", ret);
+      _data->disp_valid = false;
+      _data->cgram_known = 0;
       return ret;
    }
+   hdpcf_lane_done_locked(_data, LCD_PRIO_HIGH);
+   spin_lock(&_data->ring_lock);
+   _data->urgent_done = max(_data->urgent_done, _data->urgent_seq);
+   _data->urgent_err = 0;
+   if (_data->flush_commit_urgent)
+      _data->commit_done = _data->flush_commit_urgent;
+   spin_unlock(&_data->ring_lock);
+   wake_up_all(&_data->wait);
    return 0;
 }
 
-long hdpcf_ioctl(struct file* _file, unsigned int _cmd,
-   unsigned long _args) {
-   struct lcd_hdpcf* lcd;
-   int ret;
-   switch (_cmd) {
-      case IOCTL_LCD_UPDATE_STATE:
-         lcd = (struct lcd_hdpcf*) _args;
-         ret = lcd_update_state(lcd);
-         if (ret < 0) return ret;
-         break;
-      case IOCTL_LCD_UPDATE_DISPLAY:
-         lcd = (struct lcd_hdpcf*) _args;
-         ret = lcd_update_display(lcd);
-         if (ret < 0) return ret;
-         break;
-      case IOCTL_LCD_CLEAR:
-         ret = lcd_clear();
-         msleep(5);
-         if (ret < 0) return ret;
-         break;
-      case IOCTL_LCD_HOME:
-         ret = lcd_gotoxy(0, 0);
-         if (ret < 0) return ret;
-         break;
-      case IOCTL_LCD_SHIFT:
-         ret = lcd_shift(_args);
-         if (ret < 0) return ret;
-         break;
-      case IOCTL_LCD_SET_CHAR:
-         ret = lcd_set_char((struct user_char*)_args);
-         if (ret < 0) return ret;
-         break;
-      default:
-         printk (KERN_INFO "hdpcf: Unknown IOCTL\n");
-         break;
+/* Puts all pending requests on the bus. Clear goes first, because it drops
+content, shift and cursor position queued before it, everything else lands
+in one frame. The order of the rest doesn't matter, none of them changes
+what others do. When cursor is visible it's put back where the stream left
+it. High priority content is written before the rest of the content, which
+can be preempted; then HDPCF_PREEMPTED is returned and content, shift,
+cursor and scroll stay pending. First error is kept in flush_err until
+IOCTL_LCD_SYNC reports it. Has to be called with lock held. */
+static int hdpcf_flush_locked(struct hd44780_data* _data) {
+   unsigned long flags = _data->pending_flags;
+   int i;
+   unsigned char buf[LCD_MAX_ROWS][LCD_MAX_COLS];
+   int ret = 0;
+   if (_data->dead) return -ENODEV;
+   _data->pending_flags = 0;
+   if (_data->scroll.active && (!_data->scroll_req
+         || (flags & HDPCF_PENDING_SCROLL))) {
+      ret = hdpcf_scroll_stop_locked(_data);
+      if (ret < 0) goto flush_error;
+      if (!_data->scroll_req) flags |= HDPCF_PENDING_DISPLAY;
+   }
+   /* content and shift would be overwritten by the scrolled text anyway */
+   if (_data->scroll_req) {
+      flags &= ~(HDPCF_PENDING_DISPLAY | HDPCF_PENDING_SHIFT
+         | HDPCF_PENDING_CURSOR);
+      _data->pending_shift = 0;
+   }
+   if (flags & HDPCF_PENDING_CLEAR) {
+      ret = lcd_clear(_data);
+      if (ret < 0) goto flush_error;
+      ret = hd44780_wait_ready(_data->client, _data->timing.clear_us);
+      if (ret < 0) goto flush_error;
+   }
+   if (flags & HDPCF_PENDING_CGRAM) {
+      for (i = 0; i < 8; i++) {
+         if (!(_data->cgram_dirty & (1 << i))) continue;
+         ret = hdpcf_cgram_load(_data, i, _data->pending_cgram[i]);
+         if (ret < 0) goto flush_error;
+      }
+      _data->cgram_dirty = 0;
+   }
+   if (flags & HDPCF_PENDING_STATE) {
+      ret = lcd_update_state(_data, &_data->pending);
+      if (ret < 0) goto flush_error;
+   }
+   if (flags & HDPCF_PENDING_DISPLAY) {
+      memcpy(buf, _data->pending_buf, sizeof(buf));
+      ret = hdpcf_glyphs_resolve_locked(_data, buf);
+      if (ret < 0) goto flush_error;
+      ret = hdpcf_urgent_flush_locked(_data, buf);
+      if (ret < 0) goto flush_error;
+      ret = lcd_update_display(_data, buf, false);
+      if (ret < 0) goto flush_error;
+      if (ret == HDPCF_PREEMPTED) {
+         _data->pending_flags |= flags & (HDPCF_PENDING_DISPLAY
+            | HDPCF_PENDING_SHIFT | HDPCF_PENDING_CURSOR
+            | HDPCF_PENDING_SCROLL);
+         this_cpu_inc(_data->stats->preemptions);
+         return HDPCF_PREEMPTED;
+      }
+   }
+   if (flags & HDPCF_PENDING_SHIFT) {
+      for (i = 0; i < abs(_data->pending_shift); i++) {
+         ret = lcd_shift(_data, _data->pending_shift > 0);
+         if (ret < 0) goto flush_error;
+      }
+      _data->pending_shift = 0;
+   }
+   if (flags && !_data->scroll_req && ((flags & HDPCF_PENDING_CURSOR)
+         || _data->cursor_state || _data->cursor_blink)) {
+      ret = lcd_gotoxy(_data, _data->cursor_x, _data->cursor_y);
+      if (ret < 0) goto flush_error;
+   }
+   if ((flags & HDPCF_PENDING_SCROLL) && _data->scroll_req) {
+      ret = hdpcf_scroll_start_locked(_data);
+      if (ret < 0) goto flush_error;
+   }
+   ret = hd44780_frame_flush(_data->client);
+   if (ret < 0) {
+      _data->disp_valid = false;
+      _data->cgram_known = 0;
+      goto flush_error;
    }
    return 0;
+
+flush_error:
+   /* content may be half on the LCD, the shadow is invalid now, so the next
+   flush repaints all of it */
+   if (flags & HDPCF_PENDING_DISPLAY)
+      _data->pending_flags |= HDPCF_PENDING_DISPLAY;
+   if (!_data->flush_err) _data->flush_err = ret;
+   return ret;
 }
 
+/* Puts character to pending content. Cell is marked dirty only when it
+changes, so rewriting the same content costs nothing. Returns
+HDPCF_PENDING_DISPLAY or 0. Has to be called with lock held. */
+static unsigned long hdpcf_cell_put_locked(struct hd44780_data* _data, int _y,
+      int _x, unsigned char _c) {
+   if (_data->pending_buf[_y][_x] == _c && !_data->pending_glyph[_y][_x])
+      return 0;
+   _data->pending_buf[_y][_x] = _c;
+   _data->pending_glyph[_y][_x] = 0;
+   hdpcf_dirty(_data, _y, _x, _x + 1);
+   return HDPCF_PENDING_DISPLAY;
+}
 
-struct file_operations ops = {
-	.owner = THIS_MODULE,
-   .unlocked_ioctl = hdpcf_ioctl,
-};
+/* Content of lcd_hdpcf structure goes to the top left 16x2 corner of the
+panel. Has to be called with lock held. */
+static unsigned long hdpcf_lcd_put_locked(struct hd44780_data* _data,
+      struct lcd_hdpcf* _lcd) {
+   unsigned long flags = 0;
+   int x, y;
+   for (y = 0; y < min_t(int, _data->geom->rows, 2); y++) {
+      for (x = 0; x < min_t(int, _data->geom->cols, 16); x++)
+         flags |= hdpcf_cell_put_locked(_data, y, x, _lcd->buffer[y][x]);
+   }
+   return flags;
+}
 
-static struct class* dev_cl;
-static struct cdev dev_cdev;
+static unsigned long hdpcf_frame_put_locked(struct hd44780_data* _data,
+      struct lcd_hdpcf_frame* _frame) {
+   unsigned long flags = 0;
+   int x, y;
+   for (y = 0; y < _data->geom->rows; y++) {
+      for (x = 0; x < _data->geom->cols; x++)
+         flags |= hdpcf_cell_put_locked(_data, y, x, _frame->buffer[y][x]);
+   }
+   return flags;
+}
 
-dev_t dev_reg = MKDEV(60, 0);
+/* Takes snapshot of the mmap() page and merges parts changed since the last
+scan into pending state. Userland may write the page meanwhile, torn snapshot
+is fixed by the next scan. Returns HDPCF_PENDING_* bits of the changed state.
+Has to be called with lock held. */
+static unsigned long hdpcf_mmap_pick_locked(struct hd44780_data* _data) {
+   struct lcd_hdpcf lcd;
+   unsigned long flags = 0;
+   memcpy(&lcd, page_address(_data->mmap_page), sizeof(lcd));
+   if (memcmp(lcd.buffer, _data->mmap_seen.buffer, sizeof(lcd.buffer)))
+      flags |= hdpcf_lcd_put_locked(_data, &lcd);
+   if (lcd.cursor_state != _data->mmap_seen.cursor_state
+         || lcd.cursor_blink != _data->mmap_seen.cursor_blink
+         || lcd.display_state != _data->mmap_seen.display_state
+         || lcd.backlight_state != _data->mmap_seen.backlight_state) {
+      _data->pending.cursor_state = lcd.cursor_state;
+      _data->pending.cursor_blink = lcd.cursor_blink;
+      _data->pending.display_state = lcd.display_state;
+      _data->pending.backlight_state = lcd.backlight_state;
+      flags |= HDPCF_PENDING_STATE;
+   }
+   _data->mmap_seen = lcd;
+   return flags;
+}
 
-static int dev_ones_uevent(struct device *dev, struct kobj_uevent_env *env)
-{
-	add_uevent_var(env, "DEVMODE=%#o", 0666);
-	return 0;
+/* Clear drops everything not yet on the LCD. It also returns the display from
+shifted position and moves cursor home. */
+static void hdpcf_pending_clear_locked(struct hd44780_data* _data) {
+   memset(_data->pending_buf, ' ', sizeof(_data->pending_buf));
+   memset(_data->pending_glyph, 0, sizeof(_data->pending_glyph));
+   hdpcf_dirty_reset(_data);
+   _data->pending_shift = 0;
+   _data->cursor_x = 0;
+   _data->cursor_y = 0;
+   _data->pending_flags &= ~(HDPCF_PENDING_DISPLAY | HDPCF_PENDING_SHIFT);
 }
 
+/* DDRAM line is 40 characters long, shifting by 40 is no shift at all */
+static void hdpcf_pending_shift_locked(struct hd44780_data* _data, int _n) {
+   _data->pending_shift = (_data->pending_shift + _n) % HDPCF_DDRAM_LINE;
+}
 
-static int hd44780_i2c_driver_init(void) {
-   struct i2c_adapter *adapter = NULL;
-   int ret = 0;
-   adapter = i2c_get_adapter(1);
-   if (!adapter) {
-      printk(KERN_ERR "lcd_drv: Error while getting i2c adapter\n");
-      return -ENODEV;
+/* Slot written by the user is taken from the glyph cache. Cells of the glyph
+which had it are marked dirty, they get other slot with the next display
+update. */
+static unsigned long hdpcf_slot_user_locked(struct hd44780_data* _data,
+      int _slot) {
+   unsigned long flags = HDPCF_PENDING_CGRAM;
+   int id = _data->slots[_slot].glyph;
+   int x, y;
+   if (id >= 0) {
+      flags |= HDPCF_PENDING_DISPLAY;
+      for (y = 0; y < _data->geom->rows; y++) {
+         for (x = 0; x < _data->geom->cols; x++) {
+            if (_data->pending_glyph[y][x] == id + 1)
+               hdpcf_dirty(_data, y, x, x + 1);
+         }
+      }
    }
-   client = i2c_new_device(adapter, &info);
-   if (!client) {
-      printk(KERN_ERR "lcd_drv: Error while adding device\n");
-   }
-   ret = i2c_add_driver(&hd44780_i2c_driver);
-   if (ret < 0) {
-      printk(KERN_ERR "lcd_drv: Error while adding driver, errno: %d", ret);
+   _data->slots[_slot].glyph = HDPCF_SLOT_USER;
+   return flags;
+}
+
+/* New glyph data is uploaded by the next display update, which is needed
+only when the glyph is displayed. */
+static unsigned long hdpcf_glyph_define_locked(struct hd44780_data* _data,
+      struct lcd_glyph* _glyph) {
+   struct hdpcf_glyph* g = &_data->glyphs[_glyph->id];
+   unsigned long flags = 0;
+   int x, y;
+   memcpy(g->chr, _glyph->chr, sizeof(g->chr));
+   g->fallback = _glyph->fallback;
+   g->defined = true;
+   for (y = 0; y < _data->geom->rows; y++) {
+      for (x = 0; x < _data->geom->cols; x++) {
+         if (_data->pending_glyph[y][x] != _glyph->id + 1) continue;
+         _data->pending_buf[y][x] = g->fallback;
+         hdpcf_dirty(_data, y, x, x + 1);
+         flags = HDPCF_PENDING_DISPLAY;
+      }
    }
+   return flags;
+}
 
-   if (alloc_chrdev_region(&dev_reg, 0, 1, "char_dev") < 0) {
-		return -1;
-	}
-	if ((dev_cl = class_create(THIS_MODULE, "chardrv")) == NULL) {
-		unregister_chrdev_region(dev_reg, 1);
-		return -1;
-	}
-	dev_cl->dev_uevent = dev_ones_uevent;
-	if (device_create(dev_cl, NULL, dev_reg, NULL, "hdpcf") == NULL) {
-		class_destroy(dev_cl);
-		unregister_chrdev_region(dev_reg, 1);
-		return -1;
-	}
-	cdev_init(&dev_cdev, &ops);
-	if (cdev_add(&dev_cdev, dev_reg, 1) == -1) {
-		device_destroy(dev_cl, dev_reg);
-		class_destroy(dev_cl);
-		unregister_chrdev_region(dev_reg, 1);
-		return -1;
-	}
-	printk (KERN_INFO "hdpcf: starting...\n");
-   return 0;
+/* Stores cells to the top left 16x2 corner of pending content. Buffer gets
+fallback characters of glyph cells, slot codes are put only to the copy sent
+to the LCD. */
+static unsigned long hdpcf_cells_locked(struct hd44780_data* _data,
+      struct lcd_hdpcf_cells* _cells) {
+   unsigned long flags = 0;
+   unsigned int c, id;
+   unsigned char chr;
+   int x, y;
+   for (y = 0; y < min_t(int, _data->geom->rows, 2); y++) {
+      for (x = 0; x < min_t(int, _data->geom->cols, 16); x++) {
+         c = _cells->cells[y][x];
+         if (c < LCD_CELL_GLYPH) {
+            flags |= hdpcf_cell_put_locked(_data, y, x, c);
+            continue;
+         }
+         id = c - LCD_CELL_GLYPH;
+         if (id >= _data->nglyphs) {
+            flags |= hdpcf_cell_put_locked(_data, y, x, ' ');
+            continue;
+         }
+         chr = (_data->glyphs[id].defined) ? _data->glyphs[id].fallback : ' ';
+         if (_data->pending_glyph[y][x] == id + 1
+               && _data->pending_buf[y][x] == chr)
+            continue;
+         _data->pending_glyph[y][x] = id + 1;
+         _data->pending_buf[y][x] = chr;
+         hdpcf_dirty(_data, y, x, x + 1);
+         flags = HDPCF_PENDING_DISPLAY;
+      }
+   }
+   return flags;
 }
 
-static void hd44780_i2c_driver_exit(void) {
-   i2c_unregister_device(client);
+/* Byte stream written to the device. Text goes to the cursor position and
+some escape sequences are understood, see lcd_hdpcf.h. Parser state is kept
+per open file, so sequence can be split between write() calls. */
+enum hdpcf_esc {
+   HDPCF_ESC_NONE,
+   HDPCF_ESC_ESC,
+   HDPCF_ESC_CSI,
+};
+
+#define HDPCF_ESC_PARAMS   9
+
+/* Escape sequence state of a writer. Text waiting in the queue keeps it
+alive, so a file can be closed before its text is parsed (e.g. while the LCD
+is still being initialized). */
+struct hdpcf_parser {
+   struct kref ref;
+   enum hdpcf_esc esc;
+   int params[HDPCF_ESC_PARAMS];
+   int nparams;
+};
+
+struct hdpcf_file {
+   struct hd44780_data* data;
+   struct hdpcf_parser* parser;
+   /* Back buffer, see IOCTL_LCD_BACK_WRITE. Protected by ring_lock of the
+   device, it's copied to commit_frame under it. */
+   unsigned char back[LCD_MAX_ROWS][LCD_MAX_COLS];
+   /* LCD_PRIO_* of requests made through this file */
+   unsigned char prio;
+};
+
+static void hdpcf_parser_release(struct kref* _ref) {
+   kfree(container_of(_ref, struct hdpcf_parser, ref));
+}
+
+/* Drops reference held by queued record, if any */
+static void hdpcf_cmd_put(struct hdpcf_cmd* _cmd) {
+   if (_cmd->op == HDPCF_OP_TEXT)
+      kref_put(&_cmd->parser->ref, hdpcf_parser_release);
+}
+
+/* Executes CSI sequence with final character _final. Returns HDPCF_PENDING_*
+bits of the changed state. Has to be called with lock held. */
+static unsigned long hdpcf_csi_locked(struct hd44780_data* _data,
+      struct hdpcf_parser* _f, char _final) {
+   int n = (_f->nparams > 0 && _f->params[0] > 0) ? _f->params[0] : 1;
+   unsigned long flags;
+   int i;
+   switch (_final) {
+      case 'H':
+      case 'f':
+         _data->cursor_y = min(n, (int)_data->geom->rows) - 1;
+         n = (_f->nparams > 1 && _f->params[1] > 0) ? _f->params[1] : 1;
+         _data->cursor_x = min(n, (int)_data->geom->cols) - 1;
+         return HDPCF_PENDING_CURSOR;
+      case 'J':
+         hdpcf_pending_clear_locked(_data);
+         return HDPCF_PENDING_CLEAR | HDPCF_PENDING_CURSOR;
+      case 'K':
+         flags = 0;
+         for (i = _data->cursor_x; i < _data->geom->cols; i++)
+            flags |= hdpcf_cell_put_locked(_data, _data->cursor_y, i, ' ');
+         return flags;
+      case 'S':
+         hdpcf_pending_shift_locked(_data, -n);
+         return HDPCF_PENDING_SHIFT;
+      case 'T':
+         hdpcf_pending_shift_locked(_data, n);
+         return HDPCF_PENDING_SHIFT;
+      case 'g':
+         if (_f->nparams != HDPCF_ESC_PARAMS || _f->params[0] > 7) return 0;
+         for (i = 0; i < 8; i++)
+            _data->pending_cgram[_f->params[0]][i] = _f->params[i + 1] & 0x1f;
+         _data->cgram_dirty |= 1 << _f->params[0];
+         return hdpcf_slot_user_locked(_data, _f->params[0]);
+      default:
+         return 0;
+   }
+}
+
+/* Feeds _len bytes of the stream to the parser. Returns HDPCF_PENDING_* bits
+of the changed state. Has to be called with lock held. */
+static unsigned long hdpcf_parse_locked(struct hd44780_data* _data,
+      struct hdpcf_parser* _f, const unsigned char* _buf, size_t _len) {
+   unsigned long flags = 0;
+   unsigned char c;
+   size_t i;
+   for (i = 0; i < _len; i++) {
+      c = _buf[i];
+      switch (_f->esc) {
+         case HDPCF_ESC_ESC:
+            if (c == '[') {
+               _f->esc = HDPCF_ESC_CSI;
+               _f->nparams = 0;
+               memset(_f->params, 0, sizeof(_f->params));
+            } else {
+               _f->esc = HDPCF_ESC_NONE;
+            }
+            continue;
+         case HDPCF_ESC_CSI:
+            if (c >= '0' && c <= '9') {
+               if (_f->nparams == 0) _f->nparams = 1;
+               if (_f->nparams <= HDPCF_ESC_PARAMS
+                     && _f->params[_f->nparams - 1] < 1000)
+                  _f->params[_f->nparams - 1] =
+                     _f->params[_f->nparams - 1] * 10 + c - '0';
+            } else if (c == ';') {
+               if (_f->nparams == 0) _f->nparams = 1;
+               _f->nparams++;
+            } else {
+               if (_f->nparams <= HDPCF_ESC_PARAMS)
+                  flags |= hdpcf_csi_locked(_data, _f, c);
+               _f->esc = HDPCF_ESC_NONE;
+            }
+            continue;
+         default:
+            break;
+      }
+      switch (c) {
+         case 0x1b:
+            _f->esc = HDPCF_ESC_ESC;
+            break;
+         case '\n':
+            _data->cursor_x = 0;
+            if (_data->cursor_y < _data->geom->rows - 1) _data->cursor_y++;
+            flags |= HDPCF_PENDING_CURSOR;
+            break;
+         case '\r':
+            _data->cursor_x = 0;
+            flags |= HDPCF_PENDING_CURSOR;
+            break;
+         case '\b':
+            if (_data->cursor_x > 0) _data->cursor_x--;
+            flags |= HDPCF_PENDING_CURSOR;
+            break;
+         default:
+            /* 0x00 - 0x07 are user defined chars, other controls ignored */
+            if (c >= 0x08 && c < 0x20) break;
+            if (_data->cursor_x < _data->geom->cols) {
+               flags |= hdpcf_cell_put_locked(_data, _data->cursor_y,
+                  _data->cursor_x++, c) | HDPCF_PENDING_CURSOR;
+            }
+            break;
+      }
+   }
+   return flags;
+}
+
+/* Devices by minor number. Protected by hdpcf_devices_lock, which also
+keeps the structure from being released while open() takes a reference. */
+static DEFINE_MUTEX(hdpcf_devices_lock);
+static struct hd44780_data* hdpcf_devices[HDPCF_MAX_DEVICES];
+
+static void hdpcf_data_release(struct kref* _ref) {
+   struct hd44780_data* data = container_of(_ref, struct hd44780_data, ref);
+   /* work may still be queued by the last asynchronous request */
+   cancel_delayed_work_sync(&data->init_work);
+   hrtimer_cancel(&data->scroll.timer);
+   cancel_work_sync(&data->scroll.work);
+   cancel_delayed_work_sync(&data->mmap_work);
+   cancel_work_sync(&data->flush_work);
+   /* records the canceled flush didn't take */
+   for (; data->ring_tail != data->ring_head; data->ring_tail++)
+      hdpcf_cmd_put(&data->ring[data->ring_tail & (HDPCF_RING_SIZE - 1)]);
+   /* mappings still alive keep their own reference to the page */
+   __free_page(data->mmap_page);
+   free_percpu(data->stats);
+   kfree(data->glyphs);
+   kfree(data);
+}
+
+/* Merges one record into pending state. Content update stops scrolling
+requested before it. Returns HDPCF_PENDING_* bits of the changed state. Has
+to be called with lock held. */
+static unsigned long hdpcf_apply_locked(struct hd44780_data* _data,
+      struct hdpcf_cmd* _cmd) {
+   unsigned long flags = 0;
+   if (!_data->lane_queued[_cmd->prio])
+      _data->lane_queued[_cmd->prio] = _cmd->queued;
+   _data->apply_urgent = _cmd->prio == LCD_PRIO_HIGH;
+   switch (_cmd->op) {
+      case HDPCF_OP_STATE:
+         _data->pending.cursor_state = _cmd->lcd.cursor_state;
+         _data->pending.cursor_blink = _cmd->lcd.cursor_blink;
+         _data->pending.display_state = _cmd->lcd.display_state;
+         _data->pending.backlight_state = _cmd->lcd.backlight_state;
+         flags = HDPCF_PENDING_STATE;
+         break;
+      case HDPCF_OP_DISPLAY:
+         flags = hdpcf_lcd_put_locked(_data, &_cmd->lcd);
+         break;
+      case HDPCF_OP_FRAME:
+         flags = hdpcf_frame_put_locked(_data, &_cmd->frame);
+         break;
+      case HDPCF_OP_CLEAR:
+         hdpcf_pending_clear_locked(_data);
+         flags = HDPCF_PENDING_CLEAR;
+         break;
+      case HDPCF_OP_HOME:
+         _data->cursor_x = 0;
+         _data->cursor_y = 0;
+         flags = HDPCF_PENDING_CURSOR;
+         break;
+      case HDPCF_OP_SHIFT:
+         hdpcf_pending_shift_locked(_data, (_cmd->dir == 0) ? -1 : 1);
+         flags = HDPCF_PENDING_SHIFT;
+         break;
+      case HDPCF_OP_CHAR:
+         memcpy(_data->pending_cgram[_cmd->chr.address], _cmd->chr.chr,
+            sizeof(_cmd->chr.chr));
+         _data->cgram_dirty |= 1 << _cmd->chr.address;
+         flags = hdpcf_slot_user_locked(_data, _cmd->chr.address);
+         break;
+      case HDPCF_OP_TEXT:
+         flags = hdpcf_parse_locked(_data, _cmd->parser, _cmd->text.buf,
+            _cmd->text.len);
+         break;
+      case HDPCF_OP_MMAP:
+         flags = hdpcf_mmap_pick_locked(_data);
+         break;
+      case HDPCF_OP_GLYPH:
+         flags = hdpcf_glyph_define_locked(_data, &_cmd->glyph);
+         break;
+      case HDPCF_OP_CELLS:
+         flags = hdpcf_cells_locked(_data, &_cmd->cells);
+         break;
+      case HDPCF_OP_SCROLL:
+         memcpy(_data->scroll.text, _cmd->scroll.text,
+            sizeof(_data->scroll.text));
+         _data->scroll.len = _cmd->scroll.len;
+         _data->scroll.right = _cmd->scroll.dir != 0;
+         _data->scroll.period = ms_to_ktime(_cmd->scroll.period_ms);
+         _data->scroll_req = _cmd->scroll.len && _cmd->scroll.period_ms;
+         flags = HDPCF_PENDING_SCROLL;
+         break;
+   }
+   if (_cmd->op != HDPCF_OP_SCROLL && (flags & (HDPCF_PENDING_CLEAR
+         | HDPCF_PENDING_DISPLAY | HDPCF_PENDING_SHIFT)))
+      _data->scroll_req = false;
+   _data->apply_urgent = false;
+   _data->pending_flags |= flags;
+   return flags;
+}
+
+/* The only consumer of the queue. Everything queued so far is merged and put
+on the bus at once. Committed frame is merged at its place in the queue.
+When the flush gives way to high priority requests, they are merged too and
+the flush starts over, at most preempt_max times; content already on the LCD
+isn't written again.
+Producers waiting for room or for completion are woken up. Until the LCD is
+initialized requests stay in the queue, init work kicks the consumer when
+it's done. */
+static void hdpcf_flush_work(struct work_struct* _work) {
+   struct hd44780_data* data = container_of(_work, struct hd44780_data,
+      flush_work);
+   struct hdpcf_cmd cmd;
+   unsigned long flags;
+   u64 seq, rec, commit = 0;
+   int ret = 0;
+   mutex_lock(&data->lock);
+   if (!data->ready && !data->dead) {
+      mutex_unlock(&data->lock);
+      return;
+   }
+   data->preempt_left = preempt_max;
+
+flush_again:
+   spin_lock(&data->ring_lock);
+   while (true) {
+      if (data->commit_pending && data->commit_pos == data->ring_tail) {
+         cmd.op = HDPCF_OP_FRAME;
+         cmd.frame = data->commit_frame;
+         cmd.prio = data->commit_prio;
+         cmd.queued = data->commit_queued;
+         data->commit_pending = false;
+         commit = data->commit_seq;
+         if (cmd.prio == LCD_PRIO_HIGH) data->flush_commit_urgent = commit;
+         /* commit is waited for by its own sequence */
+         rec = 0;
+      } else if (data->ring_tail != data->ring_head) {
+         cmd = data->ring[data->ring_tail & (HDPCF_RING_SIZE - 1)];
+         data->ring_tail++;
+         if (cmd.prio == LCD_PRIO_HIGH) data->urgent_queued--;
+         rec = data->ring_tail;
+      } else {
+         break;
+      }
+      spin_unlock(&data->ring_lock);
+      /* records left after remove are only dropped */
+      if (!data->dead) {
+         flags = hdpcf_apply_locked(data, &cmd);
+         if (cmd.prio == LCD_PRIO_HIGH && rec) {
+            if (flags & (HDPCF_PENDING_SHIFT | HDPCF_PENDING_CURSOR
+                  | HDPCF_PENDING_SCROLL))
+               data->urgent_blocked = true;
+            else if (!data->urgent_blocked)
+               data->urgent_seq = rec;
+         }
+      }
+      hdpcf_cmd_put(&cmd);
+      spin_lock(&data->ring_lock);
+   }
+   seq = data->ring_tail;
+   spin_unlock(&data->ring_lock);
+   wake_up_all(&data->wait);
+   ret = hdpcf_flush_locked(data);
+   if (ret == HDPCF_PREEMPTED) {
+      data->preempt_left--;
+      goto flush_again;
+   }
+   if (ret == 0) {
+      hdpcf_lane_done_locked(data, LCD_PRIO_NORMAL);
+      hdpcf_lane_done_locked(data, LCD_PRIO_HIGH);
+   }
+   memset(data->lane_queued, 0, sizeof(data->lane_queued));
+   data->urgent_blocked = false;
+   spin_lock(&data->ring_lock);
+   data->done_seq = seq;
+   data->done_err = ret;
+   data->urgent_done = seq;
+   data->urgent_err = ret;
+   data->flush_commit_urgent = 0;
+   if (commit) data->commit_done = commit;
+   spin_unlock(&data->ring_lock);
+   /* synchronous callers got the error already */
+   if (!async_flush) data->flush_err = 0;
+   mutex_unlock(&data->lock);
+   wake_up_all(&data->wait);
+}
+
+/* Init state machine. One step is done at a time, delays of a millisecond
+and more are waited by rescheduling the work, so no CPU is burnt. Busy flag
+can't be read before 4-bit mode is set by the 0x20 nibble, from then on
+hd44780_wait_ready() is used. Calibration, if enabled, runs at the end. If
+init fails, the device is dead and queued requests get -ENODEV. */
+static void hdpcf_init_work(struct work_struct* _work) {
+   struct hd44780_data* data = container_of(to_delayed_work(_work),
+      struct hd44780_data, init_work);
+   const struct hd44780_init_step* step;
+   int ret = 0;
+   mutex_lock(&data->lock);
+   while (!data->dead && data->init_step < ARRAY_SIZE(hd44780_init_seq)) {
+      step = &hd44780_init_seq[data->init_step++];
+      if (step->nibble)
+         ret = hd44780_init_nibble(data->client, step->val);
+      else
+         ret = hd44780_i2c_send(data->client, LCD_MODE_CMD, step->val);
+      if (ret < 0) goto init_error;
+      if (!step->nibble || step->val == 0x20) {
+         ret = hd44780_wait_ready(data->client, hdpcf_cmd_us(data,
+            step->val));
+         if (ret < 0) goto init_error;
+      } else if (step->us >= 1000) {
+         mutex_unlock(&data->lock);
+         /* timer may fire up to a jiffy early */
+         schedule_delayed_work(&data->init_work,
+            usecs_to_jiffies(step->us) + 1);
+         return;
+      } else {
+         usleep_range(step->us, 2 * step->us);
+      }
+   }
+   if (!data->dead) {
+      if (calibrate) hdpcf_calibrate_locked(data);
+      lcd_shadow_blank(data);
+      spin_lock(&data->ring_lock);
+      data->ready = true;
+      spin_unlock(&data->ring_lock);
+   }
+   mutex_unlock(&data->lock);
+   wake_up_all(&data->wait);
+   schedule_work(&data->flush_work);
+   return;
+
+init_error:
+   dev_err(&data->client->dev, "lcd_drv: Error in lcd initialization, "
+      "errno: %d\n", ret);
+   spin_lock(&data->ring_lock);
+   data->dead = true;
+   data->init_err = ret;
+   spin_unlock(&data->ring_lock);
+   mutex_unlock(&data->lock);
+   wake_up_all(&data->wait);
+}
+
+static bool hdpcf_init_done(struct hd44780_data* _data) {
+   bool ret;
+   spin_lock(&_data->ring_lock);
+   ret = _data->ready || _data->dead;
+   spin_unlock(&_data->ring_lock);
+   return ret;
+}
+
+/* Waits until init work is over. Returns its error, ENODEV when the device
+was removed before. */
+static int hdpcf_wait_init(struct hd44780_data* _data) {
+   int ret = 0;
+   ret = wait_event_interruptible(_data->wait, hdpcf_init_done(_data));
+   if (ret < 0) return ret;
+   spin_lock(&_data->ring_lock);
+   if (!_data->ready) ret = (_data->init_err) ? _data->init_err : -ENODEV;
+   spin_unlock(&_data->ring_lock);
+   return ret;
+}
+
+static bool hdpcf_ring_room(struct hd44780_data* _data, unsigned int _n) {
+   bool ret;
+   spin_lock(&_data->ring_lock);
+   ret = _data->dead
+      || _data->ring_head - _data->ring_tail + _n <= HDPCF_RING_SIZE;
+   spin_unlock(&_data->ring_lock);
+   return ret;
+}
+
+/* High priority requests are done as soon as their content is on the LCD */
+static bool hdpcf_ring_done(struct hd44780_data* _data, u64 _seq,
+      int _prio) {
+   bool ret;
+   spin_lock(&_data->ring_lock);
+   ret = _data->dead || _data->done_seq >= _seq
+      || (_prio == LCD_PRIO_HIGH && _data->urgent_done >= _seq);
+   spin_unlock(&_data->ring_lock);
+   return ret;
+}
+
+/* Copies request to the queue and kicks the consumer. Latest state or
+content replaces the same kind of request of the same class still waiting
+at the end of the queue, so repeated updates don't fill it up; the request
+keeps the queueing time of the one it replaced. When the queue is full, waits
+for room unless _nonblock is set. Sequence number to wait for is returned in
+_seq. Never waits for the bus itself. */
+static int hdpcf_enqueue(struct hd44780_data* _data, struct hdpcf_cmd* _cmd,
+      bool _nonblock, u64* _seq) {
+   struct hdpcf_cmd* last;
+   int ret = 0;
+   _cmd->queued = ktime_get();
+   spin_lock(&_data->ring_lock);
+   while (true) {
+      if (_data->dead) {
+         spin_unlock(&_data->ring_lock);
+         return -ENODEV;
+      }
+      /* request made after a pending commit can't replace one before it */
+      if (_data->ring_head != _data->ring_tail
+            && !(_data->commit_pending
+            && _data->commit_pos == _data->ring_head)
+            && (_cmd->op == HDPCF_OP_STATE || _cmd->op == HDPCF_OP_DISPLAY
+            || _cmd->op == HDPCF_OP_CELLS || _cmd->op == HDPCF_OP_MMAP
+            || _cmd->op == HDPCF_OP_SCROLL || _cmd->op == HDPCF_OP_FRAME)) {
+         last = &_data->ring[(_data->ring_head - 1) & (HDPCF_RING_SIZE - 1)];
+         if (last->op == _cmd->op && last->prio == _cmd->prio) {
+            _cmd->queued = last->queued;
+            *last = *_cmd;
+            break;
+         }
+      }
+      if (_data->ring_head - _data->ring_tail < HDPCF_RING_SIZE) {
+         _data->ring[_data->ring_head & (HDPCF_RING_SIZE - 1)] = *_cmd;
+         _data->ring_head++;
+         if (_cmd->prio == LCD_PRIO_HIGH) _data->urgent_queued++;
+         break;
+      }
+      spin_unlock(&_data->ring_lock);
+      if (_nonblock) return -EAGAIN;
+      ret = wait_event_interruptible(_data->wait, hdpcf_ring_room(_data, 1));
+      if (ret < 0) return ret;
+      spin_lock(&_data->ring_lock);
+   }
+   *_seq = _data->ring_head;
+   spin_unlock(&_data->ring_lock);
+   schedule_work(&_data->flush_work);
+   return 0;
+}
+
+/* Copies _n records to the queue next to each other. The consumer takes all
+queued records before it touches the bus, so the batch always lands in one
+flush. Records are never merged with requests already queued. Waits for
+room for the whole batch unless _nonblock is set. */
+static int hdpcf_enqueue_batch(struct hd44780_data* _data,
+      struct hdpcf_cmd* _cmds, unsigned int _n, bool _nonblock, u64* _seq) {
+   ktime_t now = ktime_get();
+   unsigned int i;
+   int ret = 0;
+   BUILD_BUG_ON(LCD_SUBMIT_MAX > HDPCF_RING_SIZE);
+   spin_lock(&_data->ring_lock);
+   while (true) {
+      if (_data->dead) {
+         spin_unlock(&_data->ring_lock);
+         return -ENODEV;
+      }
+      if (_data->ring_head - _data->ring_tail + _n <= HDPCF_RING_SIZE) break;
+      spin_unlock(&_data->ring_lock);
+      if (_nonblock) return -EAGAIN;
+      ret = wait_event_interruptible(_data->wait,
+         hdpcf_ring_room(_data, _n));
+      if (ret < 0) return ret;
+      spin_lock(&_data->ring_lock);
+   }
+   for (i = 0; i < _n; i++) {
+      _cmds[i].queued = now;
+      _data->ring[_data->ring_head & (HDPCF_RING_SIZE - 1)] = _cmds[i];
+      _data->ring_head++;
+      if (_cmds[i].prio == LCD_PRIO_HIGH) _data->urgent_queued++;
+   }
+   *_seq = _data->ring_head;
+   spin_unlock(&_data->ring_lock);
+   schedule_work(&_data->flush_work);
+   return 0;
+}
+
+static bool hdpcf_commit_done(struct hd44780_data* _data, u64 _seq) {
+   bool ret;
+   spin_lock(&_data->ring_lock);
+   ret = _data->dead || _data->commit_done >= _seq;
+   spin_unlock(&_data->ring_lock);
+   return ret;
+}
+
+/* Waits until everything of class _prio queued up to _seq is on the LCD and
+returns result of that flush. */
+static int hdpcf_wait_done(struct hd44780_data* _data, u64 _seq, int _prio) {
+   int ret = 0;
+   ret = wait_event_interruptible(_data->wait, hdpcf_ring_done(_data, _seq,
+      _prio));
+   if (ret < 0) return ret;
+   spin_lock(&_data->ring_lock);
+   if (_data->dead)
+      ret = -ENODEV;
+   else
+      ret = (_data->done_seq >= _seq) ? _data->done_err : _data->urgent_err;
+   spin_unlock(&_data->ring_lock);
+   return ret;
+}
+
+/* Queues request of the file. In asynchronous mode returns at once,
+otherwise waits until the request is on the LCD. */
+static int hdpcf_submit(struct file* _file, struct hdpcf_cmd* _cmd) {
+   struct hdpcf_file* f = _file->private_data;
+   u64 seq;
+   int ret = 0;
+   _cmd->prio = f->prio;
+   ret = hdpcf_enqueue(f->data, _cmd, _file->f_flags & O_NONBLOCK, &seq);
+   if (ret < 0 || async_flush) return ret;
+   return hdpcf_wait_done(f->data, seq, f->prio);
+}
+
+/* Puts copy of the back buffer to the commit slot, replacing frame not taken
+yet, and kicks the consumer. Replaced frame passes its class and queueing
+time on, the higher class wins. Never waits for room in the queue. In
+synchronous mode waits until this or newer frame is on the LCD. */
+static int hdpcf_commit(struct file* _file) {
+   struct hdpcf_file* f = _file->private_data;
+   struct hd44780_data* data = f->data;
+   u64 seq;
+   int ret = 0;
+   spin_lock(&data->ring_lock);
+   if (data->dead) {
+      spin_unlock(&data->ring_lock);
+      return -ENODEV;
+   }
+   data->commit_frame.version = LCD_HDPCF_VERSION;
+   memcpy(data->commit_frame.buffer, f->back, sizeof(f->back));
+   if (!data->commit_pending) {
+      data->commit_queued = ktime_get();
+      data->commit_prio = f->prio;
+   } else {
+      data->commit_prio = max(data->commit_prio, f->prio);
+   }
+   data->commit_pending = true;
+   data->commit_pos = data->ring_head;
+   seq = ++data->commit_seq;
+   spin_unlock(&data->ring_lock);
+   schedule_work(&data->flush_work);
+   if (async_flush) return 0;
+   ret = wait_event_interruptible(data->wait, hdpcf_commit_done(data, seq));
+   if (ret < 0) return ret;
+   spin_lock(&data->ring_lock);
+   /* urgent_err is the newest result, high priority frame may be done early */
+   ret = (data->dead) ? -ENODEV : data->urgent_err;
+   spin_unlock(&data->ring_lock);
+   return ret;
+}
+
+/* Periodic scan of the mmap() page, rearmed as long as it is mapped */
+static void hdpcf_mmap_work(struct work_struct* _work) {
+   struct hd44780_data* data = container_of(to_delayed_work(_work),
+      struct hd44780_data, mmap_work);
+   struct hdpcf_cmd cmd = {
+      .op = HDPCF_OP_MMAP,
+   };
+   u64 seq;
+   int ret = 0;
+   /* full queue will be drained anyway, next scan catches up */
+   ret = hdpcf_enqueue(data, &cmd, true, &seq);
+   if (ret != -ENODEV && atomic_read(&data->mmap_count) > 0 && mmap_poll_ms)
+      schedule_delayed_work(&data->mmap_work,
+         msecs_to_jiffies(mmap_poll_ms));
+}
+
+/* Page content after probe matches the state of freshly initialized LCD */
+static void hdpcf_mmap_page_init(struct hd44780_data* _data) {
+   struct lcd_hdpcf* lcd = page_address(_data->mmap_page);
+   memset(lcd->buffer, ' ', sizeof(lcd->buffer));
+   lcd->buffer[0][16] = 0;
+   lcd->buffer[1][16] = 0;
+   lcd->cursor_state = false;
+   lcd->cursor_blink = false;
+   lcd->display_state = true;
+   lcd->backlight_state = true;
+   _data->mmap_seen = *lcd;
+}
+
+static int hdpcf_open(struct inode* _inode, struct file* _file) {
+   struct hdpcf_file* f;
+   f = kzalloc(sizeof(*f), GFP_KERNEL);
+   if (!f) return -ENOMEM;
+   f->parser = kzalloc(sizeof(*f->parser), GFP_KERNEL);
+   if (!f->parser) {
+      kfree(f);
+      return -ENOMEM;
+   }
+   kref_init(&f->parser->ref);
+   memset(f->back, ' ', sizeof(f->back));
+   mutex_lock(&hdpcf_devices_lock);
+   f->data = hdpcf_devices[iminor(_inode)];
+   if (f->data) kref_get(&f->data->ref);
+   mutex_unlock(&hdpcf_devices_lock);
+   if (!f->data) {
+      kfree(f->parser);
+      kfree(f);
+      return -ENODEV;
+   }
+   _file->private_data = f;
+   return 0;
+}
+
+static int hdpcf_release(struct inode* _inode, struct file* _file) {
+   struct hdpcf_file* f = _file->private_data;
+   /* queued text keeps its own reference to the parser state */
+   kref_put(&f->parser->ref, hdpcf_parser_release);
+   kref_put(&f->data->ref, hdpcf_data_release);
+   kfree(f);
+   return 0;
+}
+
+/* Stream is queued in HDPCF_TEXT_MAX pieces and parsed by the consumer, so a
+whole write() usually goes to the bus as one batch no matter how many
+sequences it contains. In synchronous mode returns when all of it is on the
+LCD. */
+static ssize_t hdpcf_write(struct file* _file, const char __user* _buf,
+      size_t _count, loff_t* _offset) {
+   struct hdpcf_file* f = _file->private_data;
+   struct hdpcf_cmd cmd = {
+      .op = HDPCF_OP_TEXT,
+      .prio = f->prio,
+      .parser = f->parser,
+   };
+   size_t done = 0;
+   u64 seq = 0;
+   int ret = 0;
+   while (done < _count) {
+      cmd.text.len = min_t(size_t, _count - done, HDPCF_TEXT_MAX);
+      if (copy_from_user(cmd.text.buf, _buf + done, cmd.text.len)) {
+         ret = -EFAULT;
+         break;
+      }
+      kref_get(&f->parser->ref);
+      ret = hdpcf_enqueue(f->data, &cmd, _file->f_flags & O_NONBLOCK, &seq);
+      if (ret < 0) {
+         hdpcf_cmd_put(&cmd);
+         break;
+      }
+      done += cmd.text.len;
+   }
+   if (done == 0) return ret;
+   if (!async_flush) {
+      ret = hdpcf_wait_done(f->data, seq, f->prio);
+      if (ret < 0) return ret;
+   }
+   return done;
+}
+
+/* Returns content as the driver knows it, one line of text ended with new
+line for each row. No bus I/O is done. */
+static ssize_t hdpcf_read(struct file* _file, char __user* _buf,
+      size_t _count, loff_t* _offset) {
+   struct hdpcf_file* f = _file->private_data;
+   struct hd44780_data* data = f->data;
+   char text[LCD_MAX_ROWS * (LCD_MAX_COLS + 1)];
+   int cols = data->geom->cols;
+   int y;
+   mutex_lock(&data->lock);
+   for (y = 0; y < data->geom->rows; y++) {
+      memcpy(&text[y * (cols + 1)], data->pending_buf[y], cols);
+      text[y * (cols + 1) + cols] = '\n';
+   }
+   mutex_unlock(&data->lock);
+   return simple_read_from_buffer(_buf, _count, _offset, text,
+      data->geom->rows * (cols + 1));
+}
+
+/* Turns operation of IOCTL_LCD_SUBMIT into queue record. Checks are the same
+as of the ioctl doing the same. */
+static int hdpcf_op_cmd(struct hd44780_data* _data, struct lcd_op* _op,
+      struct hdpcf_cmd* _cmd) {
+   memset(_cmd, 0, sizeof(*_cmd));
+   switch (_op->op) {
+      case LCD_UPDATE_STATE:
+         _cmd->op = HDPCF_OP_STATE;
+         _cmd->lcd = _op->lcd;
+         break;
+      case LCD_UPDATE_DISPLAY:
+         _cmd->op = HDPCF_OP_DISPLAY;
+         _cmd->lcd = _op->lcd;
+         break;
+      case LCD_CLEAR:
+         _cmd->op = HDPCF_OP_CLEAR;
+         break;
+      case LCD_HOME:
+         _cmd->op = HDPCF_OP_HOME;
+         break;
+      case LCD_SHIFT:
+         _cmd->op = HDPCF_OP_SHIFT;
+         _cmd->dir = (_op->dir == 0) ? 0 : 1;
+         break;
+      case LCD_SET_CHAR:
+         if (_op->chr.address > 7) return -ENXIO;
+         _cmd->op = HDPCF_OP_CHAR;
+         _cmd->chr = _op->chr;
+         break;
+      case LCD_MMAP_FLUSH:
+         _cmd->op = HDPCF_OP_MMAP;
+         break;
+      case LCD_GLYPH_DEFINE:
+         if (_op->glyph.id >= _data->nglyphs) return -ENXIO;
+         _cmd->op = HDPCF_OP_GLYPH;
+         _cmd->glyph = _op->glyph;
+         break;
+      case LCD_UPDATE_CELLS:
+         _cmd->op = HDPCF_OP_CELLS;
+         _cmd->cells = _op->cells;
+         break;
+      case LCD_SCROLL:
+         if (_op->scroll.len > LCD_SCROLL_MAX) return -EINVAL;
+         if (_data->geom->rows > 2) return -EOPNOTSUPP;
+         _cmd->op = HDPCF_OP_SCROLL;
+         _cmd->scroll = _op->scroll;
+         break;
+      case LCD_UPDATE_FRAME:
+         if (_op->frame.version != LCD_HDPCF_VERSION) return -EINVAL;
+         _cmd->op = HDPCF_OP_FRAME;
+         _cmd->frame = _op->frame;
+         break;
+      default:
+         return -EINVAL;
+   }
+   return 0;
+}
+
+/* IOCTL_LCD_SUBMIT. All ops come with one copy_from_user() and are checked
+before anything is queued, so the batch goes to the LCD whole or not at all.
+Results of rejected batch go back with one copy_to_user(). */
+static int hdpcf_submit_batch(struct file* _file, void __user* _arg) {
+   struct hdpcf_file* f = _file->private_data;
+   struct lcd_submit req;
+   struct lcd_op* batch;
+   struct hdpcf_cmd* cmds;
+   unsigned int i;
+   u64 seq;
+   int ret = 0;
+   if (copy_from_user(&req, _arg, sizeof(req))) return -EFAULT;
+   if (req.version != LCD_HDPCF_VERSION || req.count == 0
+         || req.count > LCD_SUBMIT_MAX)
+      return -EINVAL;
+   batch = memdup_user(u64_to_user_ptr(req.ops), req.count * sizeof(*batch));
+   if (IS_ERR(batch)) return PTR_ERR(batch);
+   cmds = kmalloc_array(req.count, sizeof(*cmds), GFP_KERNEL);
+   if (!cmds) {
+      ret = -ENOMEM;
+      goto submit_error;
+   }
+   for (i = 0; i < req.count; i++) {
+      batch[i].result = hdpcf_op_cmd(f->data, &batch[i], &cmds[i]);
+      if (batch[i].result < 0) ret = -EINVAL;
+      cmds[i].prio = f->prio;
+   }
+   if (ret == 0) {
+      ret = hdpcf_enqueue_batch(f->data, cmds, req.count,
+         _file->f_flags & O_NONBLOCK, &seq);
+      if (ret == 0 && !async_flush)
+         ret = hdpcf_wait_done(f->data, seq, f->prio);
+   } else {
+      for (i = 0; i < req.count; i++) {
+         if (batch[i].result == 0) batch[i].result = -ECANCELED;
+      }
+      if (copy_to_user(u64_to_user_ptr(req.ops), batch,
+            req.count * sizeof(*batch)))
+         ret = -EFAULT;
+   }
+   kfree(cmds);
+
+submit_error:
+   kfree(batch);
+   return ret;
+}
+
+static long hdpcf_do_ioctl(struct file* _file, unsigned int _cmd,
+   unsigned long _args) {
+   struct hdpcf_file* f = _file->private_data;
+   struct hd44780_data* data = f->data;
+   struct lcd_geometry geom;
+   struct lcd_back_write back;
+   struct hdpcf_cmd cmd;
+   u64 seq, commit_seq;
+   int ret = 0;
+   memset(&cmd, 0, sizeof(cmd));
+   switch (_cmd) {
+      case IOCTL_LCD_UPDATE_STATE:
+         if (copy_from_user(&cmd.lcd, (void __user*)_args, sizeof(cmd.lcd)))
+            return -EFAULT;
+         cmd.op = HDPCF_OP_STATE;
+         ret = hdpcf_submit(_file, &cmd);
+         break;
+      case IOCTL_LCD_UPDATE_DISPLAY:
+         if (copy_from_user(&cmd.lcd, (void __user*)_args, sizeof(cmd.lcd)))
+            return -EFAULT;
+         cmd.op = HDPCF_OP_DISPLAY;
+         ret = hdpcf_submit(_file, &cmd);
+         break;
+      case IOCTL_LCD_CLEAR:
+         cmd.op = HDPCF_OP_CLEAR;
+         ret = hdpcf_submit(_file, &cmd);
+         break;
+      case IOCTL_LCD_HOME:
+         cmd.op = HDPCF_OP_HOME;
+         ret = hdpcf_submit(_file, &cmd);
+         break;
+      case IOCTL_LCD_SHIFT:
+         cmd.op = HDPCF_OP_SHIFT;
+         cmd.dir = (_args == 0) ? 0 : 1;
+         ret = hdpcf_submit(_file, &cmd);
+         break;
+      case IOCTL_LCD_SET_CHAR:
+         if (copy_from_user(&cmd.chr, (void __user*)_args, sizeof(cmd.chr)))
+            return -EFAULT;
+         if (cmd.chr.address > 7) return -ENXIO;
+         cmd.op = HDPCF_OP_CHAR;
+         ret = hdpcf_submit(_file, &cmd);
+         break;
+      case IOCTL_LCD_MMAP_FLUSH:
+         cmd.op = HDPCF_OP_MMAP;
+         ret = hdpcf_submit(_file, &cmd);
+         break;
+      case IOCTL_LCD_GLYPH_DEFINE:
+         if (copy_from_user(&cmd.glyph, (void __user*)_args,
+               sizeof(cmd.glyph)))
+            return -EFAULT;
+         if (cmd.glyph.id >= data->nglyphs) return -ENXIO;
+         cmd.op = HDPCF_OP_GLYPH;
+         ret = hdpcf_submit(_file, &cmd);
+         break;
+      case IOCTL_LCD_UPDATE_CELLS:
+         if (copy_from_user(&cmd.cells, (void __user*)_args,
+               sizeof(cmd.cells)))
+            return -EFAULT;
+         cmd.op = HDPCF_OP_CELLS;
+         ret = hdpcf_submit(_file, &cmd);
+         break;
+      case IOCTL_LCD_SCROLL:
+         if (copy_from_user(&cmd.scroll, (void __user*)_args,
+               sizeof(cmd.scroll)))
+            return -EFAULT;
+         if (cmd.scroll.len > LCD_SCROLL_MAX) return -EINVAL;
+         /* display shift moves the third and the fourth row too */
+         if (data->geom->rows > 2) return -EOPNOTSUPP;
+         cmd.op = HDPCF_OP_SCROLL;
+         ret = hdpcf_submit(_file, &cmd);
+         break;
+      case IOCTL_LCD_GET_GEOMETRY:
+         memset(&geom, 0, sizeof(geom));
+         geom.version = LCD_HDPCF_VERSION;
+         geom.cols = data->geom->cols;
+         geom.rows = data->geom->rows;
+         memcpy(geom.row_offset, data->geom->row_offset,
+            sizeof(geom.row_offset));
+         if (copy_to_user((void __user*)_args, &geom, sizeof(geom)))
+            return -EFAULT;
+         break;
+      case IOCTL_LCD_UPDATE_FRAME:
+         if (copy_from_user(&cmd.frame, (void __user*)_args,
+               sizeof(cmd.frame)))
+            return -EFAULT;
+         if (cmd.frame.version != LCD_HDPCF_VERSION) return -EINVAL;
+         cmd.op = HDPCF_OP_FRAME;
+         ret = hdpcf_submit(_file, &cmd);
+         break;
+      case IOCTL_LCD_SUBMIT:
+         ret = hdpcf_submit_batch(_file, (void __user*)_args);
+         break;
+      case IOCTL_LCD_BACK_WRITE:
+         if (copy_from_user(&back, (void __user*)_args, sizeof(back)))
+            return -EFAULT;
+         if (back.version != LCD_HDPCF_VERSION
+               || back.row >= data->geom->rows
+               || back.col + back.len > data->geom->cols)
+            return -EINVAL;
+         spin_lock(&data->ring_lock);
+         memcpy(&f->back[back.row][back.col], back.text, back.len);
+         spin_unlock(&data->ring_lock);
+         break;
+      case IOCTL_LCD_COMMIT:
+         ret = hdpcf_commit(_file);
+         break;
+      case IOCTL_LCD_SET_PRIO:
+         if (_args >= LCD_PRIOS) return -EINVAL;
+         f->prio = _args;
+         break;
+      case IOCTL_LCD_SYNC:
+         /* empty queue is "done" before the LCD is even initialized */
+         ret = hdpcf_wait_init(data);
+         if (ret < 0) return ret;
+         spin_lock(&data->ring_lock);
+         seq = data->ring_head;
+         commit_seq = data->commit_seq;
+         spin_unlock(&data->ring_lock);
+         schedule_work(&data->flush_work);
+         ret = hdpcf_wait_done(data, seq, LCD_PRIO_NORMAL);
+         if (ret < 0) return ret;
+         ret = wait_event_interruptible(data->wait,
+            hdpcf_commit_done(data, commit_seq));
+         if (ret < 0) return ret;
+         mutex_lock(&data->lock);
+         ret = data->flush_err;
+         data->flush_err = 0;
+         mutex_unlock(&data->lock);
+         break;
+      default:
+         return -ENOTTY;
+   }
+   if (ret < 0) return ret;
+   return 0;
+}
+
+/* Counts the ioctl and puts its duration to the histogram */
+static void hdpcf_stats_ioctl(struct hd44780_data* _data, unsigned int _cmd,
+      s64 _ns) {
+   int bucket = min_t(int, fls64(div_u64(_ns, NSEC_PER_USEC)),
+      HDPCF_HIST_BUCKETS - 1);
+   if (_IOC_TYPE(_cmd) != IOCTL_MAGIC || _IOC_NR(_cmd) >= HDPCF_IOCTLS)
+      return;
+   this_cpu_inc(_data->stats->ioctls[_IOC_NR(_cmd)]);
+   switch (_cmd) {
+      case IOCTL_LCD_UPDATE_DISPLAY:
+      case IOCTL_LCD_UPDATE_FRAME:
+      case IOCTL_LCD_COMMIT:
+         this_cpu_inc(_data->stats->hist[HDPCF_HIST_UPDATE_DISPLAY][bucket]);
+         break;
+      case IOCTL_LCD_CLEAR:
+         this_cpu_inc(_data->stats->hist[HDPCF_HIST_CLEAR][bucket]);
+         break;
+      case IOCTL_LCD_SET_CHAR:
+         this_cpu_inc(_data->stats->hist[HDPCF_HIST_SET_CHAR][bucket]);
+         break;
+   }
+}
+
+/* Time of the whole request is traced, in synchronous mode it includes bus
+I/O done on behalf of the caller. */
+long hdpcf_ioctl(struct file* _file, unsigned int _cmd,
+   unsigned long _args) {
+   struct hdpcf_file* f = _file->private_data;
+   struct hd44780_data* data = f->data;
+   ktime_t start = ktime_get();
+   s64 duration;
+   long ret;
+   trace_hdpcf_ioctl_enter(data->minor, _cmd);
+   ret = hdpcf_do_ioctl(_file, _cmd, _args);
+   duration = ktime_to_ns(ktime_sub(ktime_get(), start));
+   trace_hdpcf_ioctl_exit(data->minor, _cmd, ret, duration);
+   hdpcf_stats_ioctl(data, _cmd, duration);
+   return ret;
+}
+
+
+static void hdpcf_vm_open(struct vm_area_struct* _vma) {
+   struct hd44780_data* data = _vma->vm_private_data;
+   kref_get(&data->ref);
+   if (atomic_inc_return(&data->mmap_count) == 1 && mmap_poll_ms)
+      schedule_delayed_work(&data->mmap_work, msecs_to_jiffies(mmap_poll_ms));
+}
+
+static void hdpcf_vm_close(struct vm_area_struct* _vma) {
+   struct hd44780_data* data = _vma->vm_private_data;
+   atomic_dec(&data->mmap_count);
+   kref_put(&data->ref, hdpcf_data_release);
+}
+
+static const struct vm_operations_struct hdpcf_vm_ops = {
+   .open = hdpcf_vm_open,
+   .close = hdpcf_vm_close,
+};
+
+/* Maps single page holding struct lcd_hdpcf. Only shared mappings make sense,
+private copy would never reach the driver. Page is scanned every
+mmap_poll_ms while mapped, IOCTL_LCD_MMAP_FLUSH picks it up at once. */
+static int hdpcf_mmap(struct file* _file, struct vm_area_struct* _vma) {
+   struct hdpcf_file* f = _file->private_data;
+   struct hd44780_data* data = f->data;
+   int ret = 0;
+   if (_vma->vm_pgoff != 0 || _vma->vm_end - _vma->vm_start > PAGE_SIZE)
+      return -EINVAL;
+   if (!(_vma->vm_flags & VM_SHARED))
+      return -EINVAL;
+   ret = vm_insert_page(_vma, _vma->vm_start, data->mmap_page);
+   if (ret < 0) return ret;
+   _vma->vm_private_data = data;
+   _vma->vm_ops = &hdpcf_vm_ops;
+   hdpcf_vm_open(_vma);
+   return 0;
+}
+
+#ifdef CONFIG_COMPAT
+/* Numbers of all ioctls encode size of unsigned long, which is 4 bytes in
+32-bit programs. They are mapped to native numbers; structures passed have
+the same layout on both, so only the pointer is converted. */
+static long hdpcf_compat_ioctl(struct file* _file, unsigned int _cmd,
+   unsigned long _args) {
+   if (_IOC_TYPE(_cmd) == IOCTL_MAGIC
+         && _IOC_SIZE(_cmd) == sizeof(compat_ulong_t))
+      _cmd = _IOC(_IOC_DIR(_cmd), IOCTL_MAGIC, _IOC_NR(_cmd),
+         sizeof(unsigned long));
+   return hdpcf_ioctl(_file, _cmd, (unsigned long)compat_ptr(_args));
+}
+#endif
+
+struct file_operations ops = {
+	.owner = THIS_MODULE,
+   .open = hdpcf_open,
+   .release = hdpcf_release,
+   .read = hdpcf_read,
+   .write = hdpcf_write,
+   .llseek = default_llseek,
+   .unlocked_ioctl = hdpcf_ioctl,
+#ifdef CONFIG_COMPAT
+   .compat_ioctl = hdpcf_compat_ioctl,
+#endif
+   .mmap = hdpcf_mmap,
+};
+
+static struct dentry* hdpcf_debugfs;
+
+static const char* const hdpcf_ioctl_names[HDPCF_IOCTLS] = {
+   [LCD_UPDATE_STATE] = "update_state",
+   [LCD_UPDATE_DISPLAY] = "update_display",
+   [LCD_CLEAR] = "clear",
+   [LCD_HOME] = "home",
+   [LCD_SHIFT] = "shift",
+   [LCD_SET_CHAR] = "set_char",
+   [LCD_SYNC] = "sync",
+   [LCD_MMAP_FLUSH] = "mmap_flush",
+   [LCD_GLYPH_DEFINE] = "glyph_define",
+   [LCD_UPDATE_CELLS] = "update_cells",
+   [LCD_SCROLL] = "scroll",
+   [LCD_GET_GEOMETRY] = "get_geometry",
+   [LCD_UPDATE_FRAME] = "update_frame",
+   [LCD_SUBMIT] = "submit",
+   [LCD_BACK_WRITE] = "back_write",
+   [LCD_COMMIT] = "commit",
+   [LCD_SET_PRIO] = "set_prio",
+};
+
+/* Sums per-CPU counters into _sum */
+static void hdpcf_stats_sum(struct hd44780_data* _data,
+      struct hdpcf_stats* _sum) {
+   struct hdpcf_stats* st;
+   unsigned long* dst = (unsigned long*)_sum;
+   unsigned long* src;
+   int cpu;
+   int i;
+   memset(_sum, 0, sizeof(*_sum));
+   for_each_possible_cpu(cpu) {
+      st = per_cpu_ptr(_data->stats, cpu);
+      src = (unsigned long*)st;
+      for (i = 0; i < sizeof(*st) / sizeof(unsigned long); i++)
+         dst[i] += READ_ONCE(src[i]);
+   }
+}
+
+/* One "name value" pair per line, easy to scrape */
+static int hdpcf_stats_show(struct seq_file* _m, void* _v) {
+   struct hd44780_data* data = _m->private;
+   struct hdpcf_stats sum;
+   int i;
+   hdpcf_stats_sum(data, &sum);
+   for (i = 0; i < HDPCF_IOCTLS; i++)
+      seq_printf(_m, "ioctl_%s %lu\n", hdpcf_ioctl_names[i], sum.ioctls[i]);
+   seq_printf(_m, "bytes %lu\n", sum.bytes);
+   seq_printf(_m, "transactions %lu\n", sum.transactions);
+   seq_printf(_m, "i2c_errors %lu\n", sum.i2c_errors);
+   seq_printf(_m, "busy_retries %lu\n", sum.busy_retries);
+   seq_printf(_m, "busy_timeouts %lu\n", sum.busy_timeouts);
+   seq_printf(_m, "cells_written %lu\n", sum.cells_written);
+   seq_printf(_m, "cells_skipped %lu\n", sum.cells_skipped);
+   seq_printf(_m, "cgram_uploads %lu\n", sum.cgram_uploads);
+   seq_printf(_m, "cgram_skipped %lu\n", sum.cgram_skipped);
+   seq_printf(_m, "preemptions %lu\n", sum.preemptions);
+   mutex_lock(&data->lock);
+   seq_printf(_m, "latency_max_us_normal %lu\n",
+      data->lane_max_us[LCD_PRIO_NORMAL]);
+   seq_printf(_m, "latency_max_us_high %lu\n",
+      data->lane_max_us[LCD_PRIO_HIGH]);
+   mutex_unlock(&data->lock);
+   return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(hdpcf_stats);
+
+/* Histogram table, first column is upper bound of the bucket in us */
+static int hdpcf_latency_show(struct seq_file* _m, void* _v) {
+   struct hd44780_data* data = _m->private;
+   struct hdpcf_stats sum;
+   int i;
+   hdpcf_stats_sum(data, &sum);
+   seq_puts(_m, "us update_display clear set_char normal high\n");
+   for (i = 0; i < HDPCF_HIST_BUCKETS; i++) {
+      seq_printf(_m, "%lu %lu %lu %lu %lu %lu\n", 1UL << i,
+         sum.hist[HDPCF_HIST_UPDATE_DISPLAY][i],
+         sum.hist[HDPCF_HIST_CLEAR][i], sum.hist[HDPCF_HIST_SET_CHAR][i],
+         sum.hist[HDPCF_HIST_LANE_NORMAL][i],
+         sum.hist[HDPCF_HIST_LANE_HIGH][i]);
+   }
+   return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(hdpcf_latency);
+
+/* Statistics are not essential, debugfs errors are ignored */
+static void hdpcf_debugfs_add(struct hd44780_data* _data) {
+   char name[16];
+   snprintf(name, sizeof(name), "hdpcf%d", _data->minor);
+   _data->debugfs = debugfs_create_dir(name, hdpcf_debugfs);
+   debugfs_create_file("stats", 0444, _data->debugfs, _data,
+      &hdpcf_stats_fops);
+   debugfs_create_file("latency", 0444, _data->debugfs, _data,
+      &hdpcf_latency_fops);
+}
+
+/* Timing profile in /sys/class/hdpcf/hdpcfN/timing, values in us. Writing
+overrides calibrated or default value. */
+#define HDPCF_TIMING_ATTR(_field)                                       \
+static ssize_t read_##_field(struct device* _dev,                       \
+      struct device_attribute* _attr, char* _buf) {                     \
+   struct hd44780_data* data = dev_get_drvdata(_dev);                   \
+   return scnprintf(_buf, PAGE_SIZE, "%u\n", data->timing._field);      \
+}                                                                       \
+static ssize_t write_##_field(struct device* _dev,                      \
+      struct device_attribute* _attr, const char* _buf,                 \
+      size_t _count) {                                                  \
+   struct hd44780_data* data = dev_get_drvdata(_dev);                   \
+   unsigned int val;                                                    \
+   int ret = 0;                                                         \
+   ret = kstrtouint(_buf, 0, &val);                                     \
+   if (ret < 0) return ret;                                             \
+   if (val > HDPCF_TIMING_MAX) return -EINVAL;                          \
+   mutex_lock(&data->lock);                                             \
+   data->timing._field = val;                                           \
+   mutex_unlock(&data->lock);                                           \
+   return _count;                                                       \
+}                                                                       \
+static DEVICE_ATTR(_field, 0644, read_##_field, write_##_field)
+
+HDPCF_TIMING_ATTR(clear_us);
+HDPCF_TIMING_ATTR(home_us);
+HDPCF_TIMING_ATTR(cmd_us);
+
+static ssize_t read_calibrated(struct device* _dev,
+      struct device_attribute* _attr, char* _buf) {
+   struct hd44780_data* data = dev_get_drvdata(_dev);
+   return scnprintf(_buf, PAGE_SIZE, "%d\n", data->timing.calibrated);
+}
+static DEVICE_ATTR(calibrated, 0444, read_calibrated, NULL);
+
+static struct attribute* hdpcf_timing_attrs[] = {
+   &dev_attr_clear_us.attr,
+   &dev_attr_home_us.attr,
+   &dev_attr_cmd_us.attr,
+   &dev_attr_calibrated.attr,
+   NULL,
+};
+
+static const struct attribute_group hdpcf_timing_group = {
+   .name = "timing",
+   .attrs = hdpcf_timing_attrs,
+};
+
+static const struct attribute_group* hdpcf_groups[] = {
+   &hdpcf_timing_group,
+   NULL,
+};
+
+static struct class* dev_cl;
+
+static dev_t dev_reg;
+
+static int hdpcf_uevent(struct device *dev, struct kobj_uevent_env *env)
+{
+	add_uevent_var(env, "DEVMODE=%#o", 0666);
+	return 0;
+}
+
+/* Takes free minor number and creates /dev/hdpcfN for the display */
+static int hdpcf_chrdev_add(struct hd44780_data* _data) {
+   struct device* dev;
+   int ret = 0;
+   int i;
+   mutex_lock(&hdpcf_devices_lock);
+   for (i = 0; i < HDPCF_MAX_DEVICES && hdpcf_devices[i]; i++);
+   if (i == HDPCF_MAX_DEVICES) {
+      mutex_unlock(&hdpcf_devices_lock);
+      return -ENOSPC;
+   }
+   _data->minor = i;
+   _data->cdev = cdev_alloc();
+   if (!_data->cdev) {
+      ret = -ENOMEM;
+      goto chrdev_error;
+   }
+   _data->cdev->owner = THIS_MODULE;
+   _data->cdev->ops = &ops;
+   ret = cdev_add(_data->cdev, MKDEV(MAJOR(dev_reg), i), 1);
+   if (ret < 0) {
+      kobject_put(&_data->cdev->kobj);
+      goto chrdev_error;
+   }
+   dev = device_create(dev_cl, &_data->client->dev, MKDEV(MAJOR(dev_reg), i),
+      _data, "hdpcf%d", i);
+   if (IS_ERR(dev)) {
+      ret = PTR_ERR(dev);
+      cdev_del(_data->cdev);
+      goto chrdev_error;
+   }
+   hdpcf_devices[i] = _data;
+   mutex_unlock(&hdpcf_devices_lock);
+   return 0;
+
+chrdev_error:
+   mutex_unlock(&hdpcf_devices_lock);
+   return ret;
+}
+
+static void hdpcf_chrdev_del(struct hd44780_data* _data) {
+   mutex_lock(&hdpcf_devices_lock);
+   hdpcf_devices[_data->minor] = NULL;
+   mutex_unlock(&hdpcf_devices_lock);
+   device_destroy(dev_cl, MKDEV(MAJOR(dev_reg), _data->minor));
+   cdev_del(_data->cdev);
+}
+
+static const struct hdpcf_geometry* hdpcf_geometry_find(unsigned int _cols,
+      unsigned int _rows) {
+   int i;
+   for (i = 0; i < ARRAY_SIZE(hdpcf_geometries); i++) {
+      if (hdpcf_geometries[i].cols == _cols
+            && hdpcf_geometries[i].rows == _rows)
+         return &hdpcf_geometries[i];
+   }
+   return NULL;
+}
+
+/* Geometry comes from platform data (module parameters) or from the device
+tree, 16x2 is the default. Returns NULL if it's not supported. */
+static const struct hdpcf_geometry* hdpcf_geometry_get(
+      struct i2c_client* _client) {
+   u32 cols = 16;
+   u32 rows = 2;
+   if (dev_get_platdata(&_client->dev))
+      return dev_get_platdata(&_client->dev);
+   if (_client->dev.of_node) {
+      of_property_read_u32(_client->dev.of_node, "columns", &cols);
+      of_property_read_u32(_client->dev.of_node, "rows", &rows);
+   }
+   return hdpcf_geometry_find(cols, rows);
+}
+
+/* Nothing special to probe() function. Allocate resources, start LCD
+initialization and create its character device. Init goes on in the
+background, requests made meanwhile are queued. Every display has its own
+lock, frame and work items, so displays don't wait for each other. */
+static int hd44780_i2c_probe(struct i2c_client* _client,
+      const struct i2c_device_id* _id) {
+   struct hd44780_data* data;
+   int ret = 0;
+   int i;
+
+   data = kzalloc(sizeof(struct hd44780_data), GFP_KERNEL);
+   if (!data) {
+      printk(KERN_CRIT "lcd_drv: Out of memory\n");
+      return -ENOMEM;
+   }
+   kref_init(&data->ref);
+   data->client = _client;
+   data->geom = hdpcf_geometry_get(_client);
+   if (!data->geom) {
+      dev_err(&_client->dev, "lcd_drv: Unsupported geometry\n");
+      kfree(data);
+      return -EINVAL;
+   }
+   data->backlight = LCD_BL;
+   data->cursor_state = 0;
+   data->cursor_blink = 0;
+   data->display_state = 1;
+   data->timing.clear_us = HDPCF_CLEAR_US;
+   data->timing.home_us = HDPCF_HOME_US;
+   data->timing.cmd_us = HDPCF_CMD_US;
+   mutex_init(&data->lock);
+   spin_lock_init(&data->ring_lock);
+   init_waitqueue_head(&data->wait);
+   INIT_WORK(&data->flush_work, hdpcf_flush_work);
+   INIT_DELAYED_WORK(&data->init_work, hdpcf_init_work);
+   INIT_DELAYED_WORK(&data->mmap_work, hdpcf_mmap_work);
+   INIT_WORK(&data->scroll.work, hdpcf_scroll_work);
+   hrtimer_init(&data->scroll.timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+   data->scroll.timer.function = hdpcf_scroll_timer;
+   data->nglyphs = min_t(unsigned int, max_glyphs,
+      0x10000 - LCD_CELL_GLYPH);
+   for (i = 0; i < 8; i++) data->slots[i].glyph = HDPCF_SLOT_FREE;
+   data->stats = alloc_percpu(struct hdpcf_stats);
+   data->mmap_page = alloc_page(GFP_KERNEL | __GFP_ZERO);
+   data->glyphs = kcalloc(data->nglyphs, sizeof(struct hdpcf_glyph),
+      GFP_KERNEL);
+   if (!data->stats || !data->mmap_page || !data->glyphs) {
+      printk(KERN_CRIT "lcd_drv: Out of memory\n");
+      if (data->mmap_page) __free_page(data->mmap_page);
+      free_percpu(data->stats);
+      kfree(data->glyphs);
+      kfree(data);
+      return -ENOMEM;
+   }
+   hdpcf_mmap_page_init(data);
+   data->pending = data->mmap_seen;
+   memset(data->pending_buf, ' ', sizeof(data->pending_buf));
+   hdpcf_dirty_reset(data);
+   i2c_set_clientdata(_client, data);
+   schedule_delayed_work(&data->init_work, 0);
+   ret = hdpcf_chrdev_add(data);
+   if (ret < 0) goto probe_error;
+   hdpcf_debugfs_add(data);
+  return 0;
+
+probe_error:
+   kref_put(&data->ref, hdpcf_data_release);
+   dev_err(&_client->dev, "lcd_drv: Probe error, errno: %d\n", ret);
+   return ret;
+
+}
+
+/* Deinitiazation on remove. Files still open see the device as dead. */
+static int hd44780_i2c_remove(struct i2c_client* _client) {
+   struct hd44780_data* data = i2c_get_clientdata(_client);
+   int ret = 0;
+   debugfs_remove_recursive(data->debugfs);
+   hdpcf_chrdev_del(data);
+   mutex_lock(&data->lock);
+   spin_lock(&data->ring_lock);
+   data->dead = true;
+   spin_unlock(&data->ring_lock);
+   mutex_unlock(&data->lock);
+   wake_up_all(&data->wait);
+   cancel_delayed_work_sync(&data->init_work);
+   hrtimer_cancel(&data->scroll.timer);
+   cancel_work_sync(&data->scroll.work);
+   cancel_delayed_work_sync(&data->mmap_work);
+   cancel_work_sync(&data->flush_work);
+   /* controller never set up (init failed or canceled) is left alone */
+   if (data->ready) ret = hd44780_i2c_deinit(_client);
+   kref_put(&data->ref, hdpcf_data_release);
+   if (ret < 0) {
+      dev_err(&_client->dev, "lcd_drv: Error while removing device, \
+         errno %d\n", ret);
+      return ret;
+   }
+   return 0;
+}
+
+/* Creates displays given by module parameters. Without any, the single
+display at bus 1, address 0x27 is created, as it always was. */
+static void hdpcf_create_clients(void) {
+   struct i2c_board_info info = {
+      .type = "hdpcf",
+   };
+   struct i2c_adapter* adapter;
+   const struct hdpcf_geometry* geom;
+   int count = max(max(bus_num, addr_num), 1);
+   unsigned int cols, rows;
+   int nr;
+   int i;
+   for (i = 0; i < count; i++) {
+      nr = (i < bus_num) ? bus[i] : 1;
+      info.addr = (i < addr_num) ? addr[i] : 0x27;
+      geom = hdpcf_geometries;
+      if (i < geometry_num) {
+         if (sscanf(geometry[i], "%ux%u", &cols, &rows) == 2)
+            geom = hdpcf_geometry_find(cols, rows);
+         else
+            geom = NULL;
+         if (!geom) {
+            printk(KERN_ERR "lcd_drv: Unsupported geometry %s\n",
+               geometry[i]);
+            continue;
+         }
+      }
+      /* platform data is only read by probe() */
+      info.platform_data = (void*)geom;
+      adapter = i2c_get_adapter(nr);
+      if (!adapter) {
+         printk(KERN_ERR "lcd_drv: Error while getting i2c adapter %d\n",
+            nr);
+         continue;
+      }
+      hdpcf_clients[i] = i2c_new_device(adapter, &info);
+      if (!hdpcf_clients[i]) {
+         printk(KERN_ERR "lcd_drv: Error while adding device 0x%02x\n",
+            info.addr);
+      }
+      i2c_put_adapter(adapter);
+   }
+}
+
+static int hd44780_i2c_driver_init(void) {
+   int ret = 0;
+   ret = alloc_chrdev_region(&dev_reg, 0, HDPCF_MAX_DEVICES, "hdpcf");
+   if (ret < 0) {
+      return ret;
+	}
+	dev_cl = class_create(THIS_MODULE, "hdpcf");
+	if (IS_ERR(dev_cl)) {
+		unregister_chrdev_region(dev_reg, HDPCF_MAX_DEVICES);
+		return PTR_ERR(dev_cl);
+	}
+	dev_cl->dev_uevent = hdpcf_uevent;
+   dev_cl->dev_groups = hdpcf_groups;
+   hdpcf_debugfs = debugfs_create_dir("hdpcf", NULL);
+   ret = i2c_add_driver(&hd44780_i2c_driver);
+   if (ret < 0) {
+      printk(KERN_ERR "lcd_drv: Error while adding driver, errno: %d", ret);
+      debugfs_remove_recursive(hdpcf_debugfs);
+      class_destroy(dev_cl);
+      unregister_chrdev_region(dev_reg, HDPCF_MAX_DEVICES);
+      return ret;
+   }
+   hdpcf_create_clients();
+	printk (KERN_INFO "hdpcf: starting...\n");
+   return 0;
+}
+
+static void hd44780_i2c_driver_exit(void) {
+   int i;
+   for (i = 0; i < HDPCF_MAX_DEVICES; i++) {
+      if (hdpcf_clients[i]) i2c_unregister_device(hdpcf_clients[i]);
+   }
    i2c_del_driver(&hd44780_i2c_driver);
- 	device_destroy(dev_cl, dev_reg);
+   debugfs_remove_recursive(hdpcf_debugfs);
 	class_destroy(dev_cl);
-	unregister_chrdev_region(dev_reg, 1);
+	unregister_chrdev_region(dev_reg, HDPCF_MAX_DEVICES);
 	printk(KERN_INFO "hdpcf: unloaded.\n");
 }
 
@@ -10,13 +10,25 @@
 #define LCD_HOME                      3
 #define LCD_SHIFT                     4
 #define LCD_SET_CHAR                  5
+#define LCD_SYNC                      6
+#define LCD_MMAP_FLUSH                7
+#define LCD_GLYPH_DEFINE              8
+#define LCD_UPDATE_CELLS              9
+#define LCD_SCROLL                    10
+#define LCD_GET_GEOMETRY              11
+#define LCD_UPDATE_FRAME              12
+#define LCD_SUBMIT                    13
+#define LCD_BACK_WRITE                14
+#define LCD_COMMIT                    15
+#define LCD_SET_PRIO                  16
 
 /* Updates LCD state without changing content. It takes pointer to lcd_hdpcf
 structure. */
 #define IOCTL_LCD_UPDATE_STATE        _IOWR(IOCTL_MAGIC, LCD_UPDATE_STATE, unsigned long)
 
 /* Updates LCD content from lcd_hdpcf stuct buffer. Pointer to lcd_hdpcf
-structure as argument */
+structure as argument. On panels bigger than 16x2 only the top left corner is
+updated, see IOCTL_LCD_UPDATE_FRAME. */
 #define IOCTL_LCD_UPDATE_DISPLAY      _IOWR(IOCTL_MAGIC, LCD_UPDATE_DISPLAY, unsigned long)
 
 /* Clears LCD. Any value as argument */
@@ -29,9 +41,127 @@ structure as argument */
 #define IOCTL_LCD_SHIFT               _IOWR(IOCTL_MAGIC, LCD_SHIFT, unsigned long)
 
 /* Sets LCD CGRAM. 8 custom charaters are avaliable. Pointer to user_char
-structure as argument. Address range from 0x0 to 0x7. */
+structure as argument. Address range from 0x0 to 0x7. Slot set this way is
+not used for glyphs anymore. */
 #define IOCTL_LCD_SET_CHAR            _IOWR(IOCTL_MAGIC, LCD_SET_CHAR, unsigned long)
 
+/* Waits until all requests are on the LCD. Needed when driver is loaded with
+async_flush=1, otherwise update ioctls return after the bus I/O anyway.
+Right after probe it waits for the LCD initialization as well and returns
+its error. Returns error of the failed background write, if any. Any value as
+argument */
+#define IOCTL_LCD_SYNC                _IOWR(IOCTL_MAGIC, LCD_SYNC, unsigned long)
+
+/* Device can be mmap()ed (one page, MAP_SHARED only). The page holds
+lcd_hdpcf structure, content and state written there are put on the LCD in
+the background, see mmap_poll_ms module parameter. This ioctl picks the page
+up at once, without waiting for the next scan. Any value as argument */
+#define IOCTL_LCD_MMAP_FLUSH          _IOWR(IOCTL_MAGIC, LCD_MMAP_FLUSH, unsigned long)
+
+/* Defines or redefines glyph in the driver's registry, which is not limited
+to 8 characters (see max_glyphs module parameter). Pointer to lcd_glyph
+structure as argument. Glyphs are uploaded to CGRAM only when displayed, see
+IOCTL_LCD_UPDATE_CELLS. */
+#define IOCTL_LCD_GLYPH_DEFINE        _IOWR(IOCTL_MAGIC, LCD_GLYPH_DEFINE, unsigned long)
+
+/* Updates LCD content from lcd_hdpcf_cells structure, which can reference
+glyphs. Cell below LCD_CELL_GLYPH is a character code, cell from
+LCD_CELL_GLYPH up is glyph LCD_CELL_GLYPH + id. Visible glyphs are mapped to
+CGRAM slots not taken by IOCTL_LCD_SET_CHAR, least recently used slot is
+replaced and glyph already in CGRAM costs no bus I/O. When there are more
+glyphs visible than free slots, fallback characters are shown for the rest.
+Pointer to lcd_hdpcf_cells structure as argument. */
+#define IOCTL_LCD_UPDATE_CELLS        _IOWR(IOCTL_MAGIC, LCD_UPDATE_CELLS, unsigned long)
+
+/* Scrolls text of both lines by display shift, every period_ms one column
+to the left (dir 0) or right (other). Driver steps on its own, no further
+calls are needed. len columns of text are used, up to LCD_SCROLL_MAX, text
+shorter than 40 columns is padded with spaces. len or period_ms 0 stops
+scrolling, so does any content update, clear or shift. Pointer to lcd_scroll
+structure as argument. Not supported on four-line panels. */
+#define IOCTL_LCD_SCROLL              _IOWR(IOCTL_MAGIC, LCD_SCROLL, unsigned long)
+
+/* Returns panel geometry in lcd_geometry structure: columns, rows and DDRAM
+address of the first character of each row. Pointer to lcd_geometry
+structure as argument. */
+#define IOCTL_LCD_GET_GEOMETRY        _IOWR(IOCTL_MAGIC, LCD_GET_GEOMETRY, unsigned long)
+
+/* Updates LCD content of any geometry from lcd_hdpcf_frame structure. Rows
+and columns past the panel size are ignored. version has to be set to
+LCD_HDPCF_VERSION. Only cells changed since the last update go to the bus.
+Pointer to lcd_hdpcf_frame structure as argument. */
+#define IOCTL_LCD_UPDATE_FRAME        _IOWR(IOCTL_MAGIC, LCD_UPDATE_FRAME, unsigned long)
+
+/* Submits up to LCD_SUBMIT_MAX operations at once, see lcd_submit structure.
+They are queued together, in order, and put on the LCD by a single flush, so
+no request of other process gets between them and nothing in the middle of
+the batch is ever shown. Each op is validated first; if any of them is
+invalid, nothing is queued and the ioctl fails with EINVAL. Then result of
+every invalid op holds its own reason and result of the valid ones is
+ECANCELED, as negative errno; results are written back to the ops array only
+in this case. Accepted batch lands in one flush, so a bus error hits all of
+its ops and is returned by the ioctl itself in synchronous mode. Pointer to
+lcd_submit structure as argument. */
+#define IOCTL_LCD_SUBMIT              _IOWR(IOCTL_MAGIC, LCD_SUBMIT, unsigned long)
+
+/* Writes text to the back buffer of the open file. Nothing is shown and no
+bus I/O is done until IOCTL_LCD_COMMIT. Back buffer covers the whole panel,
+starts blank and keeps its content after commit, so the next frame may
+change only a part of it. len characters of text go to row, from column col
+on. Pointer to lcd_back_write structure as argument. */
+#define IOCTL_LCD_BACK_WRITE          _IOWR(IOCTL_MAGIC, LCD_BACK_WRITE, unsigned long)
+
+/* Makes copy of the back buffer the next frame of the LCD. Frame is applied
+whole, after requests queued before the commit. Commit made before the
+previous one reached the LCD replaces it, so frames never wait behind each
+other and stale frame is never shown; it doesn't take room in the queue
+either. If the bus fails in the middle of a frame, the next flush (next
+request or IOCTL_LCD_SYNC) repaints it whole. In synchronous mode returns
+when this or newer frame is on the LCD. Any value as argument */
+#define IOCTL_LCD_COMMIT              _IOWR(IOCTL_MAGIC, LCD_COMMIT, unsigned long)
+
+/* Sets priority class of requests made through the open file: ioctls,
+write() and commits. Files start in LCD_PRIO_NORMAL. Content of
+LCD_PRIO_HIGH requests goes to the LCD ahead of normal content still
+waiting for the bus; flush of normal content gives way to it at the next
+character boundary (see preempt_cells module parameter) and goes on
+afterwards. One flush gives way at most preempt_max times, then normal
+content is finished first, so high priority traffic can't starve it. In
+synchronous mode high priority request returns as soon as its content is on
+the LCD; one which shifts, moves the cursor or scrolls (and every high
+priority request after it) returns when the whole flush is done. Latency of
+each class is in debugfs. Class as argument. */
+#define IOCTL_LCD_SET_PRIO            _IOWR(IOCTL_MAGIC, LCD_SET_PRIO, unsigned long)
+
+#define LCD_PRIO_NORMAL               0
+#define LCD_PRIO_HIGH                 1
+#define LCD_PRIOS                     2
+
+/* Besides ioctls, text can be written to the device. It is put at the cursor
+position, characters past the end of line are dropped. "\n" moves to the
+beginning of the next line, "\r" to the beginning of the current one, "\b"
+one character back. Codes 0x00 - 0x07 display user defined characters. Some
+VT100 like sequences are understood (n, r, c - decimal parameters):
+   ESC [ r ; c H    move cursor to row r, column c (counted from 1)
+   ESC [ H          move cursor home
+   ESC [ 2 J        clear display
+   ESC [ K          erase from cursor to end of line
+   ESC [ n S        shift display left by n
+   ESC [ n T        shift display right by n
+   ESC [ a ; r0 ; ... ; r7 g
+                    define user character a (0 - 7), rows r0 - r7
+write() is queued in 32 byte pieces, kept in order; a write() that fits in
+the queue usually goes to the LCD as one batch, but the LCD may show it
+between pieces, and a longer one waits for room partway through (with
+O_NONBLOCK the count of bytes queued so far is returned). Use IOCTL_LCD_SUBMIT
+when the update has to be atomic. Read returns current content as one line
+of text for each row, without touching the bus.
+
+Requests of all processes sharing the LCD are queued and put on the bus in
+order of arrival. The device appears before the LCD is initialized, requests
+made meanwhile are queued as well. When the queue is full, writers wait for room, or get
+EAGAIN if the device was opened with O_NONBLOCK. */
+
 struct lcd_hdpcf {
    unsigned char buffer[2][17];
    bool cursor_state;
@@ -45,6 +175,84 @@ struct user_char {
    unsigned char address;
 };
 
+struct lcd_glyph {
+   unsigned short id;
+   unsigned char chr[8];
+   unsigned char fallback;
+};
+
+#define LCD_CELL_GLYPH                0x100
+
+struct lcd_hdpcf_cells {
+   unsigned short cells[2][16];
+};
+
+#define LCD_SCROLL_MAX                64
+
+struct lcd_scroll {
+   unsigned char text[2][LCD_SCROLL_MAX];
+   unsigned short len;
+   unsigned short period_ms;
+   unsigned char dir;
+};
+
+/* Structures below start with version, so they can grow without breaking
+old binaries */
+#define LCD_HDPCF_VERSION             1
+#define LCD_MAX_ROWS                  4
+#define LCD_MAX_COLS                  40
+
+struct lcd_geometry {
+   unsigned int version;
+   unsigned char cols;
+   unsigned char rows;
+   unsigned char row_offset[LCD_MAX_ROWS];
+};
+
+struct lcd_hdpcf_frame {
+   unsigned int version;
+   unsigned char buffer[LCD_MAX_ROWS][LCD_MAX_COLS];
+};
+
+/* Operation of IOCTL_LCD_SUBMIT. op is the number of the ioctl doing the
+same (LCD_UPDATE_STATE, LCD_CLEAR, ...) and the union holds what the ioctl
+takes as argument; dir is the argument of LCD_SHIFT. LCD_SYNC,
+LCD_GET_GEOMETRY, LCD_SUBMIT, LCD_BACK_WRITE, LCD_COMMIT and LCD_SET_PRIO
+can't be batched. */
+#define LCD_SUBMIT_MAX                32
+
+struct lcd_op {
+   unsigned int op;
+   int result;
+   union {
+      struct lcd_hdpcf lcd;
+      struct user_char chr;
+      struct lcd_glyph glyph;
+      struct lcd_hdpcf_cells cells;
+      struct lcd_scroll scroll;
+      struct lcd_hdpcf_frame frame;
+      unsigned char dir;
+   };
+};
+
+/* ops is the address of count lcd_op structures, 64 bits wide so 32-bit
+programs on 64-bit kernel pass the same structure (the driver has
+compat_ioctl). version has to be set to LCD_HDPCF_VERSION. */
+struct lcd_submit {
+   unsigned int version;
+   unsigned int count;
+   unsigned long long ops;
+};
+
+/* version has to be set to LCD_HDPCF_VERSION */
+struct lcd_back_write {
+   unsigned int version;
+   unsigned char row;
+   unsigned char col;
+   unsigned char len;
+   unsigned char text[LCD_MAX_COLS];
+};
+
 
 
 #endif
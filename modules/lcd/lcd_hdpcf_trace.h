@@ -0,0 +1,162 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM hdpcf
+
+#if !defined(_LCD_HDPCF_TRACE_H_) || defined(TRACE_HEADER_MULTI_READ)
+#define _LCD_HDPCF_TRACE_H_
+
+#include <linux/tracepoint.h>
+#include <linux/i2c.h>
+
+#include "lcd_hdpcf.h"
+
+/* Tracepoints of the hdpcf driver, see /sys/kernel/debug/tracing/events/hdpcf.
+Displays are told apart by minor number (ioctls) or by I2C bus and address
+(bus I/O). All durations are in ns. */
+
+#define hdpcf_show_ioctl(nr)                                   \
+   __print_symbolic(nr,                                        \
+      { LCD_UPDATE_STATE,     "UPDATE_STATE" },                \
+      { LCD_UPDATE_DISPLAY,   "UPDATE_DISPLAY" },              \
+      { LCD_CLEAR,            "CLEAR" },                       \
+      { LCD_HOME,             "HOME" },                        \
+      { LCD_SHIFT,            "SHIFT" },                       \
+      { LCD_SET_CHAR,         "SET_CHAR" },                    \
+      { LCD_SYNC,             "SYNC" },                        \
+      { LCD_MMAP_FLUSH,       "MMAP_FLUSH" },                  \
+      { LCD_GLYPH_DEFINE,     "GLYPH_DEFINE" },                \
+      { LCD_UPDATE_CELLS,     "UPDATE_CELLS" },                \
+      { LCD_SCROLL,           "SCROLL" },                      \
+      { LCD_GET_GEOMETRY,     "GET_GEOMETRY" },                \
+      { LCD_UPDATE_FRAME,     "UPDATE_FRAME" },                \
+      { LCD_SUBMIT,           "SUBMIT" },                      \
+      { LCD_BACK_WRITE,       "BACK_WRITE" },                  \
+      { LCD_COMMIT,           "COMMIT" },                      \
+      { LCD_SET_PRIO,         "SET_PRIO" })
+
+TRACE_EVENT(hdpcf_ioctl_enter,
+   TP_PROTO(int minor, unsigned int cmd),
+   TP_ARGS(minor, cmd),
+   TP_STRUCT__entry(
+      __field(int, minor)
+      __field(unsigned int, cmd)
+   ),
+   TP_fast_assign(
+      __entry->minor = minor;
+      __entry->cmd = cmd;
+   ),
+   TP_printk("hdpcf%d cmd=%s", __entry->minor,
+      hdpcf_show_ioctl(_IOC_NR(__entry->cmd)))
+);
+
+TRACE_EVENT(hdpcf_ioctl_exit,
+   TP_PROTO(int minor, unsigned int cmd, long ret, s64 duration),
+   TP_ARGS(minor, cmd, ret, duration),
+   TP_STRUCT__entry(
+      __field(int, minor)
+      __field(unsigned int, cmd)
+      __field(long, ret)
+      __field(s64, duration)
+   ),
+   TP_fast_assign(
+      __entry->minor = minor;
+      __entry->cmd = cmd;
+      __entry->ret = ret;
+      __entry->duration = duration;
+   ),
+   TP_printk("hdpcf%d cmd=%s ret=%ld duration=%lld", __entry->minor,
+      hdpcf_show_ioctl(_IOC_NR(__entry->cmd)), __entry->ret,
+      __entry->duration)
+);
+
+/* One frame put on the bus. Cells are DDRAM characters written by the frame,
+transactions are I2C/SMBus messages it took. */
+TRACE_EVENT(hdpcf_frame_flush,
+   TP_PROTO(struct i2c_client* client, int bytes, int transactions,
+      int cells, s64 duration),
+   TP_ARGS(client, bytes, transactions, cells, duration),
+   TP_STRUCT__entry(
+      __field(int, bus)
+      __field(unsigned short, addr)
+      __field(int, bytes)
+      __field(int, transactions)
+      __field(int, cells)
+      __field(s64, duration)
+   ),
+   TP_fast_assign(
+      __entry->bus = client->adapter->nr;
+      __entry->addr = client->addr;
+      __entry->bytes = bytes;
+      __entry->transactions = transactions;
+      __entry->cells = cells;
+      __entry->duration = duration;
+   ),
+   TP_printk("%d-%04x bytes=%d transactions=%d cells=%d duration=%lld",
+      __entry->bus, __entry->addr, __entry->bytes, __entry->transactions,
+      __entry->cells, __entry->duration)
+);
+
+TRACE_EVENT(hdpcf_i2c_error,
+   TP_PROTO(struct i2c_client* client, int err),
+   TP_ARGS(client, err),
+   TP_STRUCT__entry(
+      __field(int, bus)
+      __field(unsigned short, addr)
+      __field(int, err)
+   ),
+   TP_fast_assign(
+      __entry->bus = client->adapter->nr;
+      __entry->addr = client->addr;
+      __entry->err = err;
+   ),
+   TP_printk("%d-%04x err=%d", __entry->bus, __entry->addr, __entry->err)
+);
+
+/* Fixed delay waiting for the controller */
+TRACE_EVENT(hdpcf_delay,
+   TP_PROTO(struct i2c_client* client, unsigned int us),
+   TP_ARGS(client, us),
+   TP_STRUCT__entry(
+      __field(int, bus)
+      __field(unsigned short, addr)
+      __field(unsigned int, us)
+   ),
+   TP_fast_assign(
+      __entry->bus = client->adapter->nr;
+      __entry->addr = client->addr;
+      __entry->us = us;
+   ),
+   TP_printk("%d-%04x us=%u", __entry->bus, __entry->addr, __entry->us)
+);
+
+/* Busy flag polling, ready is 0 when it timed out or failed and the fixed
+delay follows */
+TRACE_EVENT(hdpcf_busy_wait,
+   TP_PROTO(struct i2c_client* client, int polls, bool ready, s64 duration),
+   TP_ARGS(client, polls, ready, duration),
+   TP_STRUCT__entry(
+      __field(int, bus)
+      __field(unsigned short, addr)
+      __field(int, polls)
+      __field(bool, ready)
+      __field(s64, duration)
+   ),
+   TP_fast_assign(
+      __entry->bus = client->adapter->nr;
+      __entry->addr = client->addr;
+      __entry->polls = polls;
+      __entry->ready = ready;
+      __entry->duration = duration;
+   ),
+   TP_printk("%d-%04x polls=%d ready=%d duration=%lld", __entry->bus,
+      __entry->addr, __entry->polls, __entry->ready, __entry->duration)
+);
+
+#endif
+
+/* Module is built out of tree, header is found through -I$(src) set in
+Kbuild next to this file */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE lcd_hdpcf_trace
+#include <trace/define_trace.h>